@@ -0,0 +1,106 @@
+# Benchmarks for the pattern engine. Each benchmark prints one line of JSON:
+#   tomo _bench.tm -- --iterations=50 > bench_output.txt
+use <time.h>
+use ./patterns.tm
+
+struct Bench(name:Text, corpus:Text, bytes:Int, run:func(->Int))
+
+func now(-> Num)
+    return C_code:Num`({ struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts); (double)ts.tv_sec + 1e-9*(double)ts.tv_nsec; })`
+
+func allocated_bytes(-> Int)
+    return C_code:Int`I((int64_t)GC_get_total_bytes())`
+
+func ignore_match(m:PatternMatch)
+    pass
+
+func run_for_each(pattern:Pat, text:Text, matches:Int -> Int)
+    pattern.for_each(text, ignore_match)
+    return matches
+
+func as_count(found:Bool -> Int)
+    if found
+        return 1
+    return 0
+
+func time_run(run:func(->Int) -> Num)
+    start := now()
+    run()
+    return now() - start
+
+func percentile(sorted:[Num], percent:Int -> Num)
+    return sorted[(sorted.length * percent + 99) / 100]
+
+func report(bench:Bench, iterations:Int)
+    run := bench.run
+    matches := run() # Warm up (and count the matches)
+    before := allocated_bytes()
+    samples := [time_run(run) for _ in (1).to(iterations)]
+    allocated := allocated_bytes() - before
+
+    sorted := samples.sorted()
+    total := 0.0
+    for sample in samples
+        total += sample
+    total = total _max_ 1e-9
+    mb_per_sec := Num(bench.bytes * iterations) / total / 1e6
+    matches_per_sec := Num(matches * iterations) / total
+    bytes_per_match := Num(allocated) / Num((matches * iterations) _max_ 1)
+    p50_us := percentile(sorted, 50) * 1e6
+    p99_us := percentile(sorted, 99) * 1e6
+    say('{"bench":"$(bench.name)","corpus":"$(bench.corpus)","bytes":$(bench.bytes),"matches":$matches,"mb_per_sec":$mb_per_sec,"matches_per_sec":$matches_per_sec,"alloc_bytes_per_match":$bytes_per_match,"p50_us":$p50_us,"p99_us":$p99_us}')
+
+func main(iterations=20, only:Text?=none)
+    if iterations < 1
+        exit("--iterations must be at least 1")
+
+    log_lines := [
+        '10.0.$(i mod 256).$(i * 7 mod 256) - - [17/Oct/2026:13:$(i mod 60):00] "GET /api/v1/users/$i?page=$(i mod 9) HTTP/1.1" $(200 + 100 * (i mod 4)) $(i * 37 mod 5000)'
+        for i in (1).to(5000)
+    ]
+    log := "\n".join(log_lines)
+    url_lines := ["https://host$(i mod 17).example.com/path/$i/item?id=$i&sort=asc#top" for i in (1).to(5000)]
+    urls := "\n".join(url_lines)
+    prose := "Amélie a visité Москва и 東京. Ελληνικά, עברית and 🐧 penguins: naïve café résumé. ".repeat(2000)
+    nested := ("(".repeat(100) ++ "x" ++ ")".repeat(100) ++ " ").repeat(200)
+    pathological := "a=".repeat(2000)
+    # Throughput is measured in UTF-8 bytes, not graphemes:
+    log_bytes := log.utf8_bytes().length
+    url_bytes := urls.utf8_bytes().length
+    prose_bytes := prose.utf8_bytes().length
+    nested_bytes := nested.utf8_bytes().length
+    pathological_bytes := pathological.utf8_bytes().length
+
+    ip := $Pat"{int}.{int}.{int}.{int}"
+    request := $Pat"{..} - - [{..}] {..} {int} {int}"
+    server_error := $Pat" 500 {int}"
+    query := $Pat"{id}={int}"
+    word := $Pat"{alpha}"
+    words := word.count_in(prose)
+    entities := {$Pat"&"="&amp;", $Pat"="="&equals;", $Pat"#"="&num;"}
+
+    benches := [
+        Bench("match", "access_log", log_bytes, func() [l for l in log_lines if ip.match(l)].length),
+        Bench("matches", "urls", url_bytes, func() [u for u in url_lines if $Pat"{url}".matches(u)].length),
+        Bench("capture", "access_log", log_bytes, func() [l for l in log_lines if request.capture(l)].length),
+        Bench("replace", "access_log", log_bytes, func() server_error.replace(log, " 500 -").length),
+        Bench("translate", "urls", url_bytes, func() Pat.translate(entities, urls).length),
+        Bench("is_in", "access_log", log_bytes, func() as_count($Pat"ERROR".is_in(log))),
+        Bench("find_in", "urls", url_bytes, func() query.find_in(urls).length),
+        Bench("find_in", "access_log", log_bytes, func() server_error.find_in(log).length),
+        Bench("each_match", "prose", prose_bytes, func() [m for m in word.each_match(prose)].length),
+        Bench("for_each", "prose", prose_bytes, func() run_for_each(word, prose, words)),
+        Bench("map", "prose", prose_bytes, func() word.map(prose, func(m:PatternMatch) m.text.upper()).length),
+        Bench("split", "access_log", log_bytes, func() $Pat"{space}".split(log).length),
+        Bench("by_split", "prose", prose_bytes, func() [w for w in $Pat" ".by_split(prose)].length),
+        Bench("trim", "prose", prose_bytes, func() as_count($Pat"{!alpha}".trim(prose).length > 0)),
+        Bench("escape", "prose", prose_bytes, func() $Pat"$prose".text.length),
+        Bench("find_in", "nested_brackets", nested_bytes, func() $Pat"(?)".find_in(nested).length),
+        Bench("is_in", "pathological", pathological_bytes, func() as_count($Pat"{..}={..}={..}={..}!".is_in(pathological))),
+    ]
+
+    for bench in benches
+        if filter := only
+            if bench.name != filter and bench.corpus != filter
+                skip
+        report(bench, iterations)
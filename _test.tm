@@ -173,3 +173,172 @@ func main()
 	>> $Pat"{..}={..}".replace_in("A=B=C=D", "1:(@1) 2:(@2)")
 	= "1:(A) 2:(B=C=D)"
 
+	compiled := $Pat"{id}={int}".compile()
+	>> compiled.is_in("x=1")
+	= yes
+	>> compiled.find_in("a=1 b=2")
+	= [PatternMatch(text="a=1", index=1, captures=["a", "1"]), PatternMatch(text="b=2", index=5, captures=["b", "2"])]
+	>> compiled.replace("a=1 b=2", "@2=@1")
+	= "1=a 2=b"
+
+	Pat.set_cache_capacity(2)
+	>> $Pat"a".is_in("abc")
+	= yes
+	>> $Pat"a".is_in("xyz")
+	= no
+	>> $Pat"b".is_in("abc")
+	= yes
+	>> $Pat"c".is_in("abc")
+	= yes
+	>> Pat.cache_stats()
+	= PatternCacheStats(hits=1, misses=3, evictions=1, size=2, capacity=2)
+	Pat.set_cache_capacity(256)
+
+	# Pathological backtracking is memoized, so this finishes quickly:
+	>> $Pat"{..}={..}={..}={..}!".is_in("a=".repeat(2000))
+	= no
+	# (These can't be scanned in one pass, so they have to backtrack:)
+	>> $Pat"{id}={..}={..}!".is_in("a=".repeat(2000))
+	= no
+	>> $Pat"{..}={..}={..}={..}!".capture("a=".repeat(2000))
+	= none
+
+	# Patterns without captures or special matchers are scanned in one pass:
+	>> $Pat"{..}={..}={..}={..}!".is_in("a=".repeat(100000))
+	= no
+	>> $Pat",{0+ space}".split("one, two,three")
+	= ["one", "two", "three"]
+	>> $Pat"{alpha}={1-3 digit}".matches("x=123")
+	= yes
+	>> $Pat"{alpha}={1-3 digit}".matches("x=1234")
+	= no
+
+	>> $Pat"user_id={int}".find_in("name=x user=y user_id=12 user_id=3")
+	= [PatternMatch(text="user_id=12", index=15, captures=["12"]), PatternMatch(text="user_id=3", index=26, captures=["3"])]
+	>> $Pat"{2 x}y".replace_in("xy xxy xxxy", "Z")
+	= "xy Z xZ"
+
+	>> $Pat"{id}@{id}".is_in("no email addresses here")
+	= no
+	>> $Pat"{3 digit}-{4 digit}".find_in("call 555-1234 or 5555-123")
+	= [PatternMatch(text="555-1234", index=6, captures=["555", "1234"])]
+
+	# Entries are tried in order, whether or not they start with literal text:
+	>> "a <b> & <i>c</i>".translate_patterns({$Pat"<b>"="**", $Pat"<{alpha}>"="<tag>", $Pat"&"="&amp;", $Pat"</{alpha}>"="</tag>"})
+	= "a ** &amp; <tag>c</tag>"
+
+	>> $Pat"a".replace_in("ab".repeat(50000), "x") == "xb".repeat(50000)
+	= yes
+
+	# There's no fixed limit on the number of captures:
+	many := Pat.from_text("{1 alpha}".repeat(120))
+	>> many.replace_in("xy".repeat(60), "@120@1")
+	= "yx"
+
+	>> $Pat"{alpha}".find_in("1é2ž3")
+	= [PatternMatch(text="é", index=2, captures=["é"]), PatternMatch(text="ž", index=4, captures=["ž"])]
+
+	>> $Pat"{email}".find_in("mail bob@example.com or ann.lee@mail.example.org")
+	= [PatternMatch(text="bob@example.com", index=6, captures=["bob@example.com"]), PatternMatch(text="ann.lee@mail.example.org", index=25, captures=["ann.lee@mail.example.org"])]
+	>> $Pat"{url}".find_in("see https://example.com/a/b?x=1#top now")
+	= [PatternMatch(text="https://example.com/a/b?x=1#top", index=5, captures=["https://example.com/a/b?x=1#top"])]
+
+	>> $Pat",".split("x".repeat(100) ++ ",y," ++ "z".repeat(40))
+	= ["x".repeat(100), "y", "z".repeat(40)]
+	>> $Pat"needle".find_in("hay".repeat(10000) ++ "needle")
+	= [PatternMatch(text="needle", index=30001, captures=[])]
+
+	# Trailing matches are found by scanning backwards from the end:
+	>> $Pat"{space}".trim("x".repeat(100000) ++ " \t ", left=no).length
+	= 100000
+	>> $Pat"{id}.tm{end}".is_in("a/b/c.tm")
+	= yes
+	>> $Pat"{id}.tm{end}".is_in("a/b/c.tm.bak")
+	= no
+
+	(/tmp/patterns-by-line.txt).write("one\nfoo(1)\r\ntwo\nfoo(2)")
+	>> [line for line in $Pat"foo(?)".by_line("/tmp/patterns-by-line.txt")]
+	= [PatternLine(text="foo(1)", line_number=2), PatternLine(text="foo(2)", line_number=4)]
+
+	# Parallel searches give the same results as serial ones:
+	big := "x=1 yy=22 ".repeat(20000)
+	>> $Pat"{id}={int}".find_in(big, threads=7) == $Pat"{id}={int}".find_in(big, threads=1)
+	= yes
+	>> $Pat"yy=2{end}".is_in(big, threads=4)
+	= no
+	>> $Pat"y=222".is_in(big, threads=4)
+	= no
+	>> $Pat"y=22 x".is_in(big, threads=4)
+	= yes
+
+	>> $Pat"{id}={int}".is_in_each(["x=1", "nope", " y=2 "])
+	= [yes, no, yes]
+	>> $Pat"{id}={int}".capture_each(["x=1", "nope", "y=2"], threads=2)
+	= [["x", "1"]?, none, ["y", "2"]?]
+	>> $Pat"{int}".find_in_each(["1 2", ""])
+	= [[PatternMatch(text="1", index=1, captures=["1"]), PatternMatch(text="2", index=3, captures=["2"])], []]
+
+	rules := PatSet.compile([$Pat"ERROR", $Pat"WARN", $Pat"user={id}", $Pat"{int}ms", $Pat"WARNING"])
+	>> rules.indices_in("WARN: user=alice took 12ms")
+	= [2, 3, 4]
+	>> rules.indices_in("WARNING: disk", first=yes).length
+	= 1
+	>> rules.is_in("all good")
+	= no
+
+	>> $Pat"{int}".count_in("1 22 333")
+	= 3
+	>> $Pat"{id}={int}".spans_in("x=1 yy=22")
+	= [PatternSpan(start=1, len=3), PatternSpan(start=5, len=5)]
+	>> $Pat"{id}={int}".count_in(big, threads=3)
+	= 40000
+
+	>> [m.text for m in $Pat"{int}".each_match("1,22,,333")]
+	= ["1", "22", "333"]
+	>> [piece for piece in $Pat",".by_split("1,22,,333")]
+	= ["1", "22", "", "333"]
+
+	# Stats are only counted when compiled with -DPATTERN_STATS:
+	>> $Pat"{id}".stats().function_calls >= 0
+	= yes
+
+	>> $Pat"{..}={..}={..}={..}!".limit(steps=10000).find_in("a=".repeat(2000))
+	= none
+	>> $Pat"{id}={int}".limit(steps=10000).count_in("a=1 b=2")
+	= 2?
+	>> $Pat"{..}={..}={..}={..}!".limit(steps=10000).is_in("a=".repeat(2000))
+	= none
+	>> $Pat"{int}".limit(steps=10000).find_in_each(["1 2", "3"])
+	= [[PatternMatch(text="1", index=1, captures=["1"]), PatternMatch(text="2", index=3, captures=["2"])], [PatternMatch(text="3", index=1, captures=["3"])]]?
+	# A limited call inside another one's callback doesn't use up the outer budget:
+	>> $Pat"{id}".limit(steps=10000).map("ab cd", func(m:PatternMatch) "$(m.text):$($Pat"{id}={..}={..}!".limit(steps=100).count_in("a=".repeat(2000)) or -1)")
+	= "ab:-1 cd:-1"?
+
+	# Possessive repetitions never give back what they took:
+	>> $Pat"{+digit}px".find_in("12px 3em 45px")
+	= [PatternMatch(text="12px", index=1, captures=["12"]), PatternMatch(text="45px", index=10, captures=["45"])]
+	>> $Pat"{+a}ab".is_in("aab")
+	= no
+	>> $Pat"{a}ab".is_in("aab")
+	= yes
+	>> $Pat"{+}".is_in("1+2")
+	= yes
+
+	# Literal text is matched as a whole, and repetitions of the same thing in
+	# a row are matched as one when there are no captures to keep apart:
+	>> $Pat"user{digit}{2 digit}:{2 x}".find_in("user123:xx user12:xx")
+	= [PatternMatch(text="user123:xx", index=1, captures=["1", "23", "xx"])]
+	>> $Pat"{digit}{2 digit}{..}".capture("1234")
+	= ["1", "23", "4"]?
+	>> $Pat"{digit}{2 digit}".count_in("12 123 1234")
+	= 2
+	>> $Pat"{start}x".count_in("xx")
+	= 1
+
+	# Patterns starting with {start} are only tried at the start of the text:
+	>> $Pat"{start}a".replace("aaa", "b")
+	= "baa"
+	>> $Pat"{start}{space}".split(" a b")
+	= ["", "a b"]
+	>> $Pat"{start}{int}".find_in("12 34", threads=2)
+	= [PatternMatch(text="12", index=1, captures=["12"])]
@@ -1,15 +1,50 @@
 // Logic for text pattern matching
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#define GC_THREADS
 #include <gc.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/param.h>
+#include <time.h>
 #include <unictype.h>
 #include <uniname.h>
+#include <unistd.h>
+#include <unistr.h>
 #include <unistring/version.h>
 
-#define MAX_BACKREFS 100
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define DEFAULT_PATTERN_CACHE_CAPACITY 256
+#define MEMO_MIN_CALLS 1024
+#define MEMO_MAX_BITS (1L << 28)
+#define MAX_LITERAL_LEN 256
+#define NFA_MAX_STATES 256
+#define DFA_MAX_STATES 1024
+#define LINE_READER_CHUNK_SIZE (64 * 1024)
+#define PARALLEL_MIN_LENGTH (1L << 20)
+#define PARALLEL_MAX_THREADS 64
+#define PARALLEL_PIECE_LENGTH (64 * 1024)
+#define BUDGET_CLOCK_INTERVAL 256
+
+// Profiling counters are only kept when compiled with -DPATTERN_STATS. They
+// are charged to the pattern being matched, so everything that reads the text
+// for a match context starts with TRACK_STATS(). Reads of the text go through
+// grapheme_at(), which counts them; reads of patterns and replacements don't.
+#ifdef PATTERN_STATS
+#define COUNT_STAT(field)                                                                                              \
+    (current_stats ? (void)__atomic_fetch_add(&current_stats->field, 1, __ATOMIC_RELAXED) : (void)0)
+#define TRACK_STATS(ctx) (current_stats = (ctx)->pattern->stats)
+#else
+#define COUNT_STAT(field) ((void)0)
+#define TRACK_STATS(ctx) ((void)0)
+#endif
 
 #ifndef new
 #define new(t, ...) ((t *)memcpy(GC_MALLOC(sizeof(t)), &(t){__VA_ARGS__}, sizeof(t)))
@@ -32,23 +67,287 @@ typedef struct {
 
 typedef struct {
     int64_t index, length;
-    bool occupied, recursive;
+    bool recursive;
 } capture_t;
 
+// Membership of code points in a Unicode property: a bitmap for ASCII, plus
+// bitmaps for 256-code-point blocks of the Basic Multilingual Plane that get
+// filled in the first time something from that block is looked up:
+typedef struct property_table_s {
+    uc_property_t property;
+    uint64_t ascii[2];
+    uint64_t *bmp_blocks[256];
+    struct property_table_s *next;
+} property_table_t;
+
 typedef struct {
-    enum { PAT_START, PAT_END, PAT_ANY, PAT_GRAPHEME, PAT_PROPERTY, PAT_QUOTE, PAT_PAIR, PAT_FUNCTION } tag;
+    enum { PAT_START, PAT_END, PAT_ANY, PAT_GRAPHEME, PAT_PROPERTY, PAT_QUOTE, PAT_PAIR, PAT_FUNCTION, PAT_STRING } tag;
     bool negated, non_capturing;
+    bool possessive; // Takes as many repetitions as it can and never gives any back
     int64_t min, max;
     union {
         int32_t grapheme;
-        uc_property_t property;
+        property_table_t *property;
         int64_t (*fn)(TextIter_t *, int64_t);
         int32_t quote_graphemes[2];
         int32_t pair_graphemes[2];
+        struct {
+            const int32_t *graphemes;
+            int64_t length;
+        } string; // Only in the backtracking matcher's programs (see `optimize_pats()`)
     };
 } pat_t;
 
-static Text_t replace_list(Text_t text, List_t replacements, Text_t backref_marker, bool recursive);
+// A Thompson NFA for patterns made up only of single-grapheme elements. Each
+// element `i` gets the states `base[i] + count` for counts 0..cap[i] (an
+// unbounded repetition's count saturates at its minimum), and the state
+// numbered `num_states` means the whole pattern has matched:
+typedef struct {
+    const pat_t *pats;
+    int64_t num_pats, num_states, num_words;
+    int64_t *base, *cap, *state_pat;
+} nfa_t;
+
+// A Pike VM thread: an NFA state, and where the match it's following started:
+typedef struct {
+    int64_t state, start;
+} nfa_thread_t;
+
+// A lazily built DFA over an NFA's state sets, used for scanning when we only
+// need to know whether there is a match somewhere:
+typedef struct {
+    int32_t next[128]; // Transitions on ASCII graphemes, or -1 if not yet known
+    bool accepting, accepting_with_start, empty;
+} dfa_state_t;
+
+typedef struct {
+    dfa_state_t *states;
+    uint64_t *sets; // NFA state set of each DFA state (`num_words` each)
+    uint64_t *start_set;
+    int32_t *index; // Open-addressed hash of state IDs (offset by one)
+    int64_t num_states, capacity, resets;
+} dfa_t;
+
+// A pattern's DFA is kept between searches, but only one thread at a time may
+// use it (since using it also builds it), so it's guarded by a lock:
+typedef struct {
+    pthread_mutex_t lock;
+    dfa_t *dfa;
+} dfa_cache_t;
+
+// A run of literal graphemes, with Boyer-Moore-Horspool shifts indexed by
+// the low byte of a grapheme:
+typedef struct {
+    int32_t *graphemes;
+    int64_t length;
+    int64_t *skip;
+    char *bytes; // The literal as ASCII bytes, or NULL if it isn't all ASCII
+} literal_t;
+
+typedef struct {
+    int64_t starts, recursions, backtracks, function_calls, graphemes;
+} pattern_stats_t;
+
+typedef struct {
+    Text_t source;
+    pat_t *pats;
+    int64_t num_pats;
+    int64_t num_captures;
+    literal_t prefix; // Literal text that every match starts with
+    literal_t required; // Literal text that every match contains...
+    int64_t required_min_offset, required_max_offset; // ...this far after the start of the match
+    bool can_backtrack;
+    nfa_t *nfa; // NULL if the pattern needs the backtracking matcher
+    dfa_cache_t *dfa_cache; // NULL if there is no NFA
+    // The pattern's elements in reverse order (minus any trailing `{end}`),
+    // for matching backwards from the end of the text, or NULL:
+    nfa_t *reverse_nfa;
+    pattern_stats_t *stats; // NULL unless compiled with -DPATTERN_STATS
+    // What the backtracking matcher runs: `pats` with literal text fused into
+    // strings, and a shorter version for when captures aren't needed:
+    pat_t *program, *fast_program;
+    int64_t program_length, fast_program_length;
+    int64_t min_length, max_length; // Bounds on the length of any match
+    bool anchored; // Matches can only start at the start of the text
+} compiled_pattern_t;
+
+typedef struct {
+    TextIter_t text_state;
+    const compiled_pattern_t *pattern;
+    // Bitset of (pattern element, text index) pairs that are known not to
+    // match, allocated once backtracking gets expensive (one for each of the
+    // pattern's programs):
+    uint64_t *failures, *fast_failures;
+    int64_t calls, memo_threshold;
+    // Next known occurrence of the pattern's required literal, or -1:
+    int64_t next_required;
+    capture_t *captures;
+    // A DFA of this search's own, for when another thread is using the
+    // pattern's one:
+    dfa_t *dfa;
+    // Scratch space for the Pike VM, allocated on first use and kept for the
+    // rest of the search. `nfa_seen` holds the last step each state was added
+    // at, and steps keep counting up across searches so it never needs
+    // clearing:
+    nfa_thread_t *nfa_threads;
+    int64_t *nfa_seen, nfa_step;
+} match_ctx_t;
+
+typedef struct {
+    compiled_pattern_t *pattern;
+    Text_t replacement;
+} replacement_t;
+
+typedef struct {
+    int64_t node, child; // `child == 0` marks an empty slot, since the root is never a child
+    int32_t grapheme;
+} trie_edge_t;
+
+// A list of replacements along with an index for finding which of them could
+// match at a given position, so we don't have to try every one of them:
+typedef struct {
+    replacement_t *entries;
+    int64_t length;
+    // A trie of the entries' literal prefixes, with the entries whose prefix
+    // ends at each node linked together in priority order:
+    trie_edge_t *edges;
+    int64_t num_edge_slots;
+    int64_t *node_entries, *next_in_node;
+    // Entries without a literal prefix, in priority order:
+    int64_t *wildcards;
+    int64_t num_wildcards;
+} replacement_set_t;
+
+typedef struct pattern_cache_entry_s {
+    uint64_t hash;
+    compiled_pattern_t *compiled;
+    struct pattern_cache_entry_s *newer, *older; // LRU order
+    struct pattern_cache_entry_s *next_in_bucket;
+} pattern_cache_entry_t;
+
+typedef struct {
+    Int_t hits, misses, evictions, size, capacity;
+} PatternCacheStats;
+
+typedef struct {
+    Int_t starts, recursions, backtracks, function_calls, graphemes;
+} PatternStats;
+
+typedef struct {
+    Text_t text;
+    Int_t line_number;
+} PatternLine;
+
+typedef struct {
+    Text_t text;
+    Int_t line_number;
+    bool is_none : 1;
+} OptionalPatternLine;
+
+#define NONE_LINE ((OptionalPatternLine){.is_none = true})
+
+typedef struct {
+    Int_t start, len;
+} PatternSpan;
+
+// Where a match is, as a 0-based offset, while searching:
+typedef struct {
+    int64_t start, length;
+} span_t;
+
+// Process-wide LRU cache of compiled patterns, keyed by pattern text. It's
+// only touched while holding `pattern_cache_lock`:
+static struct {
+    pattern_cache_entry_t **buckets;
+    int64_t num_buckets;
+    pattern_cache_entry_t *newest, *oldest;
+    int64_t size, capacity;
+    int64_t hits, misses, evictions;
+} pattern_cache = {.capacity = DEFAULT_PATTERN_CACHE_CAPACITY};
+static pthread_mutex_t pattern_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef PATTERN_STATS
+// The stats of the pattern being matched on this thread (or NULL while
+// parsing a pattern):
+static __thread pattern_stats_t *current_stats = NULL;
+#endif
+
+// A limit on how much backtracking the current thread may do before matching
+// gives up, set around calls made through `LimitedPat`. Calls can be nested
+// (from a `map()` or `for_each()` callback), so each budget keeps the one it
+// replaced, to be put back when it ends:
+typedef struct match_budget_s {
+    bool limited;
+    volatile bool exceeded; // Read back after calls the compiler can't see into
+    int64_t steps, max_steps; // `max_steps == 0` for no step limit
+    double deadline; // Monotonic clock time in seconds, or 0 for no deadline
+    struct match_budget_s *outer; // malloc()ed, since thread-locals aren't GC roots
+} match_budget_t;
+
+static __thread match_budget_t match_budget = {};
+
+static property_table_t *property_tables = NULL;
+static pthread_mutex_t property_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Text_t replace_list(Text_t text, const replacement_set_t *replacements, Text_t backref_marker, bool recursive);
+
+static property_table_t *get_property_table(uc_property_t property) {
+    pthread_mutex_lock(&property_tables_lock);
+    property_table_t *table = property_tables;
+    while (table && memcmp(&table->property, &property, sizeof(property)) != 0)
+        table = table->next;
+    if (!table) {
+        table = new (property_table_t, .property = property, .next = property_tables);
+        for (ucs4_t c = 0; c < 128; c++) {
+            if (uc_is_property(c, property)) table->ascii[c / 64] |= (1ul << (c % 64));
+        }
+        property_tables = table;
+    }
+    pthread_mutex_unlock(&property_tables_lock);
+    return table;
+}
+
+static bool has_property_slow(property_table_t *table, int32_t grapheme) {
+    if (grapheme < 0 || grapheme >= 0x10000) return uc_is_property((ucs4_t)grapheme, table->property);
+    // Blocks may be filled in by several threads at once, but they all fill
+    // them in the same way, so it doesn't matter whose block ends up stored:
+    uint64_t *block = __atomic_load_n(&table->bmp_blocks[grapheme >> 8], __ATOMIC_ACQUIRE);
+    if (!block) {
+        block = GC_MALLOC_ATOMIC(sizeof(uint64_t[4]));
+        memset(block, 0, sizeof(uint64_t[4]));
+        ucs4_t first = (ucs4_t)grapheme & ~0xFFu;
+        for (ucs4_t c = 0; c < 256; c++) {
+            if (uc_is_property(first + c, table->property)) block[c / 64] |= (1ul << (c % 64));
+        }
+        __atomic_store_n(&table->bmp_blocks[grapheme >> 8], block, __ATOMIC_RELEASE);
+    }
+    return (block[(grapheme & 0xFF) / 64] >> (grapheme % 64)) & 1;
+}
+
+static INLINE bool has_property(property_table_t *table, int32_t grapheme) {
+    if ((uint32_t)grapheme < 128) return (table->ascii[grapheme / 64] >> (grapheme % 64)) & 1;
+    return has_property_slow(table, grapheme);
+}
+
+// The table for a property that's known ahead of time, looked up only once:
+#define PROPERTY_TABLE(property)                                                                                       \
+    ({                                                                                                                 \
+        static property_table_t *_table = NULL;                                                                       \
+        property_table_t *_found = __atomic_load_n(&_table, __ATOMIC_ACQUIRE);                                         \
+        if (!_found) {                                                                                                 \
+            _found = get_property_table(property);                                                                     \
+            __atomic_store_n(&_table, _found, __ATOMIC_RELEASE);                                                       \
+        }                                                                                                              \
+        _found;                                                                                                        \
+    })
+
+static INLINE int32_t grapheme_at(TextIter_t *state, int64_t index) {
+    // Most text is plain ASCII, which we can read directly:
+    COUNT_STAT(graphemes);
+    Text_t text = state->stack[0].text;
+    if (text.tag == TEXT_ASCII) return index < text.length ? (int32_t)(uint8_t)text.ascii[index] : 0;
+    return Text$get_grapheme_fast(state, index);
+}
 
 static INLINE void skip_whitespace(TextIter_t *state, int64_t *i) {
     while (*i < state->stack[0].text.length) {
@@ -59,7 +358,7 @@ static INLINE void skip_whitespace(TextIter_t *state, int64_t *i) {
 }
 
 static INLINE bool match_grapheme(TextIter_t *state, int64_t *i, int32_t grapheme) {
-    if (*i < state->stack[0].text.length && Text$get_grapheme_fast(state, *i) == grapheme) {
+    if (*i < state->stack[0].text.length && grapheme_at(state, *i) == grapheme) {
         *i += 1;
         return true;
     }
@@ -69,7 +368,7 @@ static INLINE bool match_grapheme(TextIter_t *state, int64_t *i, int32_t graphem
 static INLINE bool match_str(TextIter_t *state, int64_t *i, const char *str) {
     int64_t matched = 0;
     while (matched[str]) {
-        if (*i + matched >= state->stack[0].text.length || Text$get_grapheme_fast(state, *i + matched) != str[matched])
+        if (*i + matched >= state->stack[0].text.length || grapheme_at(state, *i + matched) != str[matched])
             return false;
         matched += 1;
     }
@@ -113,9 +412,69 @@ static const char *get_property_name(TextIter_t *state, int64_t *i) {
     return name;
 }
 
+// Character classes used by the structured matchers (email, URIs, etc.):
+enum {
+    CHAR_EMAIL_LOCAL = 1 << 0,
+    CHAR_DNS_LABEL = 1 << 1,
+    CHAR_HOST = 1 << 2,
+    CHAR_SEGMENT = 1 << 3,
+    CHAR_SCHEME = 1 << 4,
+    CHAR_PATH = 1 << 5,
+    CHAR_QUERY = 1 << 6, // Also used for fragments
+    CHAR_DIGIT = 1 << 7,
+};
+
+// The classes that all non-ASCII graphemes belong to:
+#define NON_ASCII_CHAR_CLASSES                                                                                         \
+    (CHAR_EMAIL_LOCAL | CHAR_DNS_LABEL | CHAR_HOST | CHAR_SEGMENT | CHAR_PATH | CHAR_QUERY)
+
+static uint8_t char_classes[256];
+static bool char_classes_ready = false;
+
+static void init_char_classes(void) {
+    for (int c = 0; c < 256; c++) {
+        if (c >= 128) {
+            char_classes[c] = NON_ASCII_CHAR_CLASSES;
+            continue;
+        }
+        uint8_t classes = 0;
+        if (isalnum(c) || strchr("!#$%&‘*+–/=?^_`.{|}~", c)) classes |= CHAR_EMAIL_LOCAL;
+        if (isalnum(c) || c == '-') classes |= CHAR_DNS_LABEL;
+        if (!strchr("/#?:@ \t\r\n<>[]{}\\^|\"`", c)) classes |= CHAR_HOST;
+        if (!strchr("/#?:@ \t\r\n<>[]{}\\^|\"`.", c)) classes |= CHAR_SEGMENT;
+        if (isalnum(c) || c == '+' || c == '.' || c == '-') classes |= CHAR_SCHEME;
+        if (!strchr(" \"#?<>[]{}\\^`|", c)) classes |= CHAR_PATH;
+        if (!strchr(" \"#<>[]{}\\^`|", c)) classes |= CHAR_QUERY;
+        if (isdigit(c)) classes |= CHAR_DIGIT;
+        char_classes[c] = classes;
+    }
+    char_classes_ready = true;
+}
+
+static int64_t span_of_class(TextIter_t *state, int64_t index, uint8_t char_class, int64_t limit) {
+    // Counts how many graphemes in a row (up to `limit + 1`) starting at
+    // `index` belong to a character class:
+    if (!char_classes_ready) init_char_classes();
+    Text_t text = state->stack[0].text;
+    int64_t end = limit < text.length - index ? index + limit + 1 : text.length;
+    int64_t i = index;
+    if (text.tag == TEXT_ASCII) {
+        const uint8_t *bytes = (const uint8_t *)text.ascii;
+        while (i < end && (char_classes[bytes[i]] & char_class))
+            i++;
+    } else {
+        for (; i < end; i++) {
+            int32_t grapheme = grapheme_at(state, i);
+            uint8_t classes = (grapheme & ~0x7F) ? NON_ASCII_CHAR_CLASSES : char_classes[grapheme];
+            if (!(classes & char_class)) break;
+        }
+    }
+    return i - index;
+}
+
 #define EAT1(state, index, cond)                                                                                       \
     ({                                                                                                                 \
-        int32_t grapheme = Text$get_grapheme_fast(state, index);                                                       \
+        int32_t grapheme = grapheme_at(state, index);                                                                  \
         bool success = (cond);                                                                                         \
         if (success) index += 1;                                                                                       \
         success;                                                                                                       \
@@ -123,10 +482,10 @@ static const char *get_property_name(TextIter_t *state, int64_t *i) {
 
 #define EAT2(state, index, cond1, cond2)                                                                               \
     ({                                                                                                                 \
-        int32_t grapheme = Text$get_grapheme_fast(state, index);                                                       \
+        int32_t grapheme = grapheme_at(state, index);                                                                  \
         bool success = (cond1);                                                                                        \
         if (success) {                                                                                                 \
-            grapheme = Text$get_grapheme_fast(state, index + 1);                                                       \
+            grapheme = grapheme_at(state, index + 1);                                                                  \
             success = (cond2);                                                                                         \
             if (success) index += 2;                                                                                   \
         }                                                                                                              \
@@ -156,25 +515,20 @@ static int64_t match_email(TextIter_t *state, int64_t index) {
     int64_t start_index = index;
 
     // Local part:
-    int64_t local_len = 0;
-    static const char *allowed_local = "!#$%&‘*+–/=?^_`.{|}~";
-    while (EAT1(state, index, (grapheme & ~0x7F) || isalnum((char)grapheme) || strchr(allowed_local, (char)grapheme))) {
-        local_len += 1;
-        if (local_len > 64) return -1;
-    }
+    int64_t local_len = span_of_class(state, index, CHAR_EMAIL_LOCAL, 64);
+    if (local_len > 64) return -1;
+    index += local_len;
+    // There's no '@' after a local part that runs to the end of the text:
+    if (index >= state->stack[0].text.length) return -1;
 
     if (!EAT1(state, index, grapheme == '@')) return -1;
 
     // Host
     int64_t host_len = 0;
     do {
-        int64_t label_len = 0;
-        while (EAT1(state, index, (grapheme & ~0x7F) || isalnum((char)grapheme) || grapheme == '-')) {
-            label_len += 1;
-            if (label_len > 63) return -1;
-        }
-
-        if (label_len == 0) return -1;
+        int64_t label_len = span_of_class(state, index, CHAR_DNS_LABEL, 63);
+        if (label_len == 0 || label_len > 63) return -1;
+        index += label_len;
 
         host_len += label_len;
         if (host_len > 255) return -1;
@@ -186,7 +540,7 @@ static int64_t match_email(TextIter_t *state, int64_t index) {
 
 static int64_t match_ipv6(TextIter_t *state, int64_t index) {
     if (index > 0) {
-        int32_t prev_codepoint = Text$get_grapheme_fast(state, index - 1);
+        int32_t prev_codepoint = grapheme_at(state, index - 1);
         if ((prev_codepoint & ~0x7F) && (isxdigit(prev_codepoint) || prev_codepoint == ':')) return -1;
     }
     int64_t start_index = index;
@@ -215,7 +569,7 @@ static int64_t match_ipv6(TextIter_t *state, int64_t index) {
 
 static int64_t match_ipv4(TextIter_t *state, int64_t index) {
     if (index > 0) {
-        int32_t prev_codepoint = Text$get_grapheme_fast(state, index - 1);
+        int32_t prev_codepoint = grapheme_at(state, index - 1);
         if ((prev_codepoint & ~0x7F) && (isdigit(prev_codepoint) || prev_codepoint == '.')) return -1;
     }
     int64_t start_index = index;
@@ -259,17 +613,16 @@ static int64_t match_host(TextIter_t *state, int64_t index) {
 
     if (!EAT1(state, index, isalpha(grapheme))) return -1;
 
-    static const char *non_host_chars = "/#?:@ \t\r\n<>[]{}\\^|\"`";
-    EAT_MANY(state, index, (grapheme & ~0x7F) || !strchr(non_host_chars, (char)grapheme));
+    index += span_of_class(state, index, CHAR_HOST, INT64_MAX);
     return (index - start_index);
 }
 
 static int64_t match_authority(TextIter_t *state, int64_t index) {
     int64_t authority_start = index;
-    static const char *non_segment_chars = "/#?:@ \t\r\n<>[]{}\\^|\"`.";
 
     // Optional user@ prefix:
-    int64_t username_len = EAT_MANY(state, index, (grapheme & ~0x7F) || !strchr(non_segment_chars, (char)grapheme));
+    int64_t username_len = span_of_class(state, index, CHAR_SEGMENT, INT64_MAX);
+    index += username_len;
     if (username_len < 1 || !EAT1(state, index, grapheme == '@')) index = authority_start; // No user@ part
 
     // Host:
@@ -279,7 +632,9 @@ static int64_t match_authority(TextIter_t *state, int64_t index) {
 
     // Port:
     if (EAT1(state, index, grapheme == ':')) {
-        if (EAT_MANY(state, index, !(grapheme & ~0x7F) && isdigit(grapheme)) == 0) return -1;
+        int64_t port_len = span_of_class(state, index, CHAR_DIGIT, INT64_MAX);
+        if (port_len == 0) return -1;
+        index += port_len;
     }
     return (index - authority_start);
 }
@@ -299,8 +654,7 @@ static int64_t match_uri(TextIter_t *state, int64_t index) {
 
     // Scheme:
     if (!EAT1(state, index, isalpha(grapheme))) return -1;
-    EAT_MANY(state, index,
-             !(grapheme & ~0x7F) && (isalnum(grapheme) || grapheme == '+' || grapheme == '.' || grapheme == '-'));
+    index += span_of_class(state, index, CHAR_SCHEME, INT64_MAX);
     if (!match_grapheme(state, &index, ':')) return -1;
 
     // Authority:
@@ -315,18 +669,13 @@ static int64_t match_uri(TextIter_t *state, int64_t index) {
     // Path:
     int64_t path_start = index;
     if (EAT1(state, index, grapheme == '/') || authority_len <= 0) {
-        static const char *non_path = " \"#?<>[]{}\\^`|";
-        EAT_MANY(state, index, (grapheme & ~0x7F) || !strchr(non_path, (char)grapheme));
+        index += span_of_class(state, index, CHAR_PATH, INT64_MAX);
 
-        if (EAT1(state, index, grapheme == '?')) { // Query
-            static const char *non_query = " \"#<>[]{}\\^`|";
-            EAT_MANY(state, index, (grapheme & ~0x7F) || !strchr(non_query, (char)grapheme));
-        }
+        if (EAT1(state, index, grapheme == '?')) // Query
+            index += span_of_class(state, index, CHAR_QUERY, INT64_MAX);
 
-        if (EAT1(state, index, grapheme == '#')) { // Fragment
-            static const char *non_fragment = " \"#<>[]{}\\^`|";
-            EAT_MANY(state, index, (grapheme & ~0x7F) || !strchr(non_fragment, (char)grapheme));
-        }
+        if (EAT1(state, index, grapheme == '#')) // Fragment
+            index += span_of_class(state, index, CHAR_QUERY, INT64_MAX);
     }
 
     if (authority_len <= 0 && index == path_start) return -1;
@@ -345,28 +694,31 @@ static int64_t match_url(TextIter_t *state, int64_t index) {
 }
 
 static int64_t match_id(TextIter_t *state, int64_t index) {
-    if (!EAT1(state, index, uc_is_property((ucs4_t)grapheme, UC_PROPERTY_XID_START))) return -1;
-    return 1 + EAT_MANY(state, index, uc_is_property((ucs4_t)grapheme, UC_PROPERTY_XID_CONTINUE));
+    property_table_t *xid_start = PROPERTY_TABLE(UC_PROPERTY_XID_START);
+    property_table_t *xid_continue = PROPERTY_TABLE(UC_PROPERTY_XID_CONTINUE);
+    if (!EAT1(state, index, has_property(xid_start, grapheme))) return -1;
+    return 1 + EAT_MANY(state, index, has_property(xid_continue, grapheme));
 }
 
 static int64_t match_int(TextIter_t *state, int64_t index) {
+    property_table_t *digit = PROPERTY_TABLE(UC_PROPERTY_DECIMAL_DIGIT);
     int64_t negative = EAT1(state, index, grapheme == '-') ? 1 : 0;
-    int64_t len = EAT_MANY(state, index, uc_is_property((ucs4_t)grapheme, UC_PROPERTY_DECIMAL_DIGIT));
+    int64_t len = EAT_MANY(state, index, has_property(digit, grapheme));
     return len > 0 ? negative + len : -1;
 }
 
 static int64_t match_alphanumeric(TextIter_t *state, int64_t index) {
-    return EAT1(state, index, uc_is_property_alphabetic((ucs4_t)grapheme) || uc_is_property_numeric((ucs4_t)grapheme))
-               ? 1
-               : -1;
+    property_table_t *alphabetic = PROPERTY_TABLE(UC_PROPERTY_ALPHABETIC);
+    property_table_t *numeric = PROPERTY_TABLE(UC_PROPERTY_NUMERIC);
+    return EAT1(state, index, has_property(alphabetic, grapheme) || has_property(numeric, grapheme)) ? 1 : -1;
 }
 
 static int64_t match_num(TextIter_t *state, int64_t index) {
+    property_table_t *digit = PROPERTY_TABLE(UC_PROPERTY_DECIMAL_DIGIT);
     bool negative = EAT1(state, index, grapheme == '-') ? 1 : 0;
-    int64_t pre_decimal = EAT_MANY(state, index, uc_is_property((ucs4_t)grapheme, UC_PROPERTY_DECIMAL_DIGIT));
+    int64_t pre_decimal = EAT_MANY(state, index, has_property(digit, grapheme));
     bool decimal = (EAT1(state, index, grapheme == '.') == 1);
-    int64_t post_decimal =
-        decimal ? EAT_MANY(state, index, uc_is_property((ucs4_t)grapheme, UC_PROPERTY_DECIMAL_DIGIT)) : 0;
+    int64_t post_decimal = decimal ? EAT_MANY(state, index, has_property(digit, grapheme)) : 0;
     if (pre_decimal == 0 && post_decimal == 0) return -1;
     return negative + pre_decimal + decimal + post_decimal;
 }
@@ -376,13 +728,13 @@ static int64_t match_newline(TextIter_t *state, int64_t index) {
 
     uint32_t grapheme = index >= state->stack[0].text.length ? 0 : Text$get_main_grapheme_fast(state, index);
     if (grapheme == '\n') return 1;
-    if (grapheme == '\r' && Text$get_grapheme_fast(state, index + 1) == '\n') return 2;
+    if (grapheme == '\r' && grapheme_at(state, index + 1) == '\n') return 2;
     return -1;
 }
 
 static int64_t match_pat(TextIter_t *state, int64_t index, pat_t pat) {
     Text_t text = state->stack[0].text;
-    int32_t grapheme = index >= text.length ? 0 : Text$get_grapheme_fast(state, index);
+    int32_t grapheme = index >= text.length ? 0 : grapheme_at(state, index);
 
     switch (pat.tag) {
     case PAT_START: {
@@ -404,7 +756,7 @@ static int64_t match_pat(TextIter_t *state, int64_t index, pat_t pat) {
     }
     case PAT_PROPERTY: {
         if (index >= text.length) return -1;
-        else if (uc_is_property((ucs4_t)grapheme, pat.property)) return pat.negated ? -1 : 1;
+        else if (has_property(pat.property, grapheme)) return pat.negated ? -1 : 1;
         return pat.negated ? 1 : -1;
     }
     case PAT_PAIR: {
@@ -420,7 +772,7 @@ static int64_t match_pat(TextIter_t *state, int64_t index, pat_t pat) {
         for (; depth > 0; match_len++) {
             if (index + match_len >= text.length) return pat.negated ? 1 : -1;
 
-            int32_t c = Text$get_grapheme_fast(state, index + match_len);
+            int32_t c = grapheme_at(state, index + match_len);
             if (c == open) depth += 1;
             else if (c == close) depth -= 1;
         }
@@ -435,7 +787,7 @@ static int64_t match_pat(TextIter_t *state, int64_t index, pat_t pat) {
 
         int32_t close = pat.quote_graphemes[1];
         for (int64_t i = index + 1; i < text.length; i++) {
-            int32_t c = Text$get_grapheme_fast(state, i);
+            int32_t c = grapheme_at(state, i);
             if (c == close) {
                 return pat.negated ? -1 : (i - index) + 1;
             } else if (c == '\\' && index + 1 < text.length) {
@@ -444,7 +796,15 @@ static int64_t match_pat(TextIter_t *state, int64_t index, pat_t pat) {
         }
         return pat.negated ? 1 : -1;
     }
+    case PAT_STRING: {
+        if (index + pat.string.length > text.length) return -1;
+        for (int64_t i = 0; i < pat.string.length; i++) {
+            if (grapheme_at(state, index + i) != pat.string.graphemes[i]) return -1;
+        }
+        return pat.string.length;
+    }
     case PAT_FUNCTION: {
+        COUNT_STAT(function_calls);
         int64_t match_len = pat.fn(state, index);
         if (match_len >= 0) return pat.negated ? -1 : match_len;
         return pat.negated ? 1 : -1;
@@ -505,8 +865,18 @@ static pat_t parse_next_pat(TextIter_t *state, int64_t *index) {
 
         skip_whitespace(state, index);
 
+        // Possessive repetitions are marked with a `+`, like `{+digit}` (but
+        // `{+}` is still a literal plus sign):
+        bool possessive = false;
+        if (Text$get_grapheme_fast(state, *index) == '+' && Text$get_grapheme_fast(state, *index + 1) != '}') {
+            possessive = true;
+            *index += 1;
+            skip_whitespace(state, index);
+        }
+
         bool negated = match_grapheme(state, index, '!');
-#define PAT(_tag, ...) ((pat_t){.min = min, .max = max, .negated = negated, .tag = _tag, __VA_ARGS__})
+#define PAT(_tag, ...)                                                                                                 \
+    ((pat_t){.min = min, .max = max, .negated = negated, .possessive = possessive, .tag = _tag, __VA_ARGS__})
         const char *prop_name;
         if (match_str(state, index, "..")) prop_name = "..";
         else prop_name = get_property_name(state, index);
@@ -550,7 +920,7 @@ static pat_t parse_next_pat(TextIter_t *state, int64_t *index) {
             break;
         case 'd':
             if (strcasecmp(prop_name, "digit") == 0) {
-                return PAT(PAT_PROPERTY, .property = UC_PROPERTY_DECIMAL_DIGIT);
+                return PAT(PAT_PROPERTY, .property = get_property_table(UC_PROPERTY_DECIMAL_DIGIT));
             }
             break;
         case 'e':
@@ -561,7 +931,7 @@ static pat_t parse_next_pat(TextIter_t *state, int64_t *index) {
             }
 #if _LIBUNISTRING_VERSION >= 0x0100000
             else if (strcasecmp(prop_name, "emoji") == 0) {
-                return PAT(PAT_PROPERTY, .property = UC_PROPERTY_EMOJI);
+                return PAT(PAT_PROPERTY, .property = get_property_table(UC_PROPERTY_EMOJI));
             }
 #endif
             break;
@@ -585,7 +955,7 @@ static pat_t parse_next_pat(TextIter_t *state, int64_t *index) {
             break;
         case 'l':
             if (strcasecmp(prop_name, "letter") == 0) {
-                return PAT(PAT_PROPERTY, .property = UC_PROPERTY_ALPHABETIC);
+                return PAT(PAT_PROPERTY, .property = get_property_table(UC_PROPERTY_ALPHABETIC));
             }
         case 'n':
             if (strcasecmp(prop_name, "nl") == 0 || strcasecmp(prop_name, "newline") == 0) {
@@ -610,14 +980,14 @@ static pat_t parse_next_pat(TextIter_t *state, int64_t *index) {
             if (strcasecmp(prop_name, "word") == 0) {
                 return PAT(PAT_FUNCTION, .fn = match_id);
             } else if (strcasecmp(prop_name, "ws") == 0 || strcasecmp(prop_name, "whitespace") == 0) {
-                return PAT(PAT_PROPERTY, .property = UC_PROPERTY_WHITE_SPACE);
+                return PAT(PAT_PROPERTY, .property = get_property_table(UC_PROPERTY_WHITE_SPACE));
             }
             break;
         default: break;
         }
 
         uc_property_t prop = uc_property_byname(prop_name);
-        if (uc_property_is_valid(prop)) return PAT(PAT_PROPERTY, .property = prop);
+        if (uc_property_is_valid(prop)) return PAT(PAT_PROPERTY, .property = get_property_table(prop));
 
         ucs4_t grapheme = unicode_name_character(prop_name);
         if (grapheme == UNINAME_INVALID) fail_text(Texts("Not a valid property or character name: ", prop_name));
@@ -632,37 +1002,526 @@ static pat_t parse_next_pat(TextIter_t *state, int64_t *index) {
     }
 }
 
-static int64_t match(Text_t text, int64_t text_index, Text_t pattern, int64_t pattern_index, capture_t *captures,
-                     int64_t capture_index) {
-    if (pattern_index >= pattern.length) // End of the pattern
-        return 0;
+static nfa_t *compile_nfa(const pat_t *pats, int64_t num_pats) {
+    if (num_pats == 0) return NULL;
+    int64_t num_states = 0;
+    for (int64_t i = 0; i < num_pats; i++) {
+        if (pats[i].tag != PAT_ANY && pats[i].tag != PAT_GRAPHEME && pats[i].tag != PAT_PROPERTY) return NULL;
+        // (The last element takes as many repetitions as it can anyway)
+        if (pats[i].possessive && i + 1 < num_pats) return NULL;
+        int64_t cap = pats[i].max == INT64_MAX ? pats[i].min : pats[i].max;
+        if (cap < 0 || cap >= NFA_MAX_STATES - num_states) return NULL;
+        num_states += cap + 1;
+    }
 
-    int64_t start_index = text_index;
-    TextIter_t pattern_state = NEW_TEXT_ITER_STATE(pattern), text_state = NEW_TEXT_ITER_STATE(text);
-    pat_t pat = parse_next_pat(&pattern_state, &pattern_index);
+    nfa_t *nfa = new (nfa_t, .pats = pats, .num_pats = num_pats, .num_states = num_states,
+                      .num_words = (num_states + 1 + 63) / 64);
+    nfa->base = GC_MALLOC_ATOMIC(sizeof(int64_t) * (size_t)num_pats);
+    nfa->cap = GC_MALLOC_ATOMIC(sizeof(int64_t) * (size_t)num_pats);
+    nfa->state_pat = GC_MALLOC_ATOMIC(sizeof(int64_t) * (size_t)num_states);
+    for (int64_t i = 0, state = 0; i < num_pats; i++) {
+        nfa->base[i] = state;
+        nfa->cap[i] = pats[i].max == INT64_MAX ? pats[i].min : pats[i].max;
+        for (int64_t count = 0; count <= nfa->cap[i]; count++)
+            nfa->state_pat[state++] = i;
+    }
+    return nfa;
+}
+
+static INLINE int64_t saturating_add(int64_t a, int64_t b) { return a > INT64_MAX - b ? INT64_MAX : a + b; }
 
-    if (pat.min == -1 && pat.max == -1) {
-        if (pat.tag == PAT_ANY && pattern_index >= pattern.length) {
-            pat.min = pat.max = MAX(1, text.length - text_index);
+static INLINE int64_t saturating_mul(int64_t a, int64_t b) {
+    return (a == 0 || b == 0) ? 0 : (a > INT64_MAX / b ? INT64_MAX : a * b);
+}
+
+static int64_t min_pat_length(pat_t pat) {
+    // Fewest graphemes a single repetition of an element can match:
+    return (pat.tag == PAT_ANY || pat.tag == PAT_GRAPHEME || pat.tag == PAT_PROPERTY) ? 1 : 0;
+}
+
+static int64_t max_pat_length(pat_t pat) {
+    // Most graphemes a single repetition of an element can match:
+    switch (pat.tag) {
+    case PAT_START:
+    case PAT_END: return 0;
+    case PAT_ANY:
+    case PAT_GRAPHEME:
+    case PAT_PROPERTY: return 1;
+    default: return INT64_MAX;
+    }
+}
+
+static int64_t literal_length(pat_t pat) {
+    // Number of copies of a literal grapheme that an element always matches:
+    return (pat.tag == PAT_GRAPHEME && !pat.negated) ? pat.min : 0;
+}
+
+static literal_t literal_run(const pat_t *pats, int64_t num_pats, int64_t start) {
+    // The run ends after the first element that might repeat more times:
+    int64_t length = 0;
+    for (int64_t i = start; i < num_pats && length < MAX_LITERAL_LEN && literal_length(pats[i]) > 0; i++) {
+        length = MIN(length + literal_length(pats[i]), MAX_LITERAL_LEN);
+        if (pats[i].min != pats[i].max) break;
+    }
+    if (length == 0) return (literal_t){};
+
+    literal_t literal = {
+        .graphemes = GC_MALLOC_ATOMIC(sizeof(int32_t) * (size_t)length),
+        .length = length,
+        .skip = GC_MALLOC_ATOMIC(sizeof(int64_t) * 256),
+    };
+    for (int64_t i = start, n = 0; n < length; i++) {
+        for (int64_t count = 0; count < pats[i].min && n < length; count++)
+            literal.graphemes[n++] = pats[i].grapheme;
+    }
+    literal.bytes = GC_MALLOC_ATOMIC((size_t)length);
+    for (int64_t i = 0; i < length && literal.bytes; i++) {
+        if (literal.graphemes[i] & ~0x7F) literal.bytes = NULL;
+        else literal.bytes[i] = (char)literal.graphemes[i];
+    }
+    for (int b = 0; b < 256; b++)
+        literal.skip[b] = length;
+    // Graphemes that share a low byte share a slot, so keep the smallest shift:
+    for (int64_t i = 0; i + 1 < length; i++)
+        literal.skip[(uint32_t)literal.graphemes[i] & 0xFF] = length - 1 - i;
+    return literal;
+}
+
+static bool same_repeated(pat_t a, pat_t b) {
+    // Whether two elements repeat the same single-grapheme match:
+    if (a.tag != b.tag || a.negated != b.negated || a.possessive || b.possessive) return false;
+    switch (a.tag) {
+    case PAT_ANY: return true;
+    case PAT_GRAPHEME: return a.grapheme == b.grapheme;
+    case PAT_PROPERTY: return a.property == b.property;
+    default: return false;
+    }
+}
+
+static pat_t *optimize_pats(const pat_t *pats, int64_t num_pats, bool with_captures, int64_t *program_length) {
+    // Builds a program for the backtracking matcher. Runs of literal graphemes
+    // become a single string element, so they take one step to match instead
+    // of one per grapheme. With captures, only the pattern's plain characters
+    // (which aren't captured) are fused. Without captures, counted literals
+    // like `{3 x}` are fused too, and adjacent repetitions of the same thing
+    // are merged (`{digit}{2 digit}` into `{3+ digit}`). Merging keeps the
+    // same matches, since the rest of the pattern only sees where the run
+    // ends, except when a lazy run is merged into the last element, which
+    // would make it greedy.
+    pat_t *merged = GC_MALLOC(sizeof(pat_t) * (size_t)MAX(num_pats, 1));
+    int64_t num_merged = 0;
+    for (int64_t i = 0; i < num_pats; i++) {
+        pat_t *prev = num_merged > 0 ? &merged[num_merged - 1] : NULL;
+        if (!with_captures && prev && same_repeated(*prev, pats[i])
+            && (prev->min == prev->max || i + 1 < num_pats)) {
+            prev->min = saturating_add(prev->min, pats[i].min);
+            prev->max = saturating_add(prev->max, pats[i].max);
         } else {
+            merged[num_merged++] = pats[i];
+        }
+    }
+
+    pat_t *program = GC_MALLOC(sizeof(pat_t) * (size_t)MAX(num_merged, 1));
+    int64_t length = 0;
+    for (int64_t i = 0; i < num_merged;) {
+        int64_t end = i, string_length = 0;
+        while (end < num_merged && merged[end].tag == PAT_GRAPHEME && !merged[end].negated
+               && !merged[end].possessive && merged[end].min == merged[end].max
+               && (merged[end].non_capturing || !with_captures)
+               && string_length + merged[end].min <= MAX_LITERAL_LEN) {
+            string_length += merged[end].min;
+            end += 1;
+        }
+        if (end - i < 2) {
+            program[length++] = merged[i++];
+            continue;
+        }
+
+        int32_t *graphemes = GC_MALLOC_ATOMIC(sizeof(int32_t) * (size_t)MAX(string_length, 1));
+        for (int64_t n = 0; i < end; i++) {
+            for (int64_t count = 0; count < merged[i].min; count++)
+                graphemes[n++] = merged[i].grapheme;
+        }
+        program[length++] = (pat_t){
+            .tag = PAT_STRING,
+            .non_capturing = true,
+            .min = 1,
+            .max = 1,
+            .string = {graphemes, string_length},
+        };
+    }
+    *program_length = length;
+    return program;
+}
+
+static compiled_pattern_t *compile_pattern(Text_t pattern) {
+    // Each pattern element consumes at least one grapheme of the pattern
+    // source, so the source length is an upper bound on the element count:
+    pat_t *pats = GC_MALLOC(sizeof(pat_t) * (size_t)MAX(pattern.length, 1));
+    int64_t num_pats = 0, num_captures = 0;
+#ifdef PATTERN_STATS
+    // Reading the pattern itself isn't charged to any pattern's stats:
+    pattern_stats_t *outer_stats = current_stats;
+    current_stats = NULL;
+#endif
+    TextIter_t pattern_state = NEW_TEXT_ITER_STATE(pattern);
+    for (int64_t pattern_index = 0; pattern_index < pattern.length;) {
+        pat_t pat = parse_next_pat(&pattern_state, &pattern_index);
+        if (pat.min == -1 && pat.max == -1) {
             pat.min = 1;
             pat.max = INT64_MAX;
         }
+        if (!pat.non_capturing) num_captures += 1;
+        pats[num_pats++] = pat;
+    }
+
+    // Optimization: every match has to start with the literal graphemes of the
+    // leading elements (like `ab` in `ab{..}` or `xx` in `{2 x}`), so we can
+    // search for those directly instead of trying every position:
+    literal_t prefix = literal_run(pats, num_pats, 0);
+
+    // Likewise, a literal in the middle of the pattern (like `@` in
+    // `{id}@{id}`) has to show up within a known distance of where any match
+    // starts. We use the longest one, if it's longer than the prefix:
+    literal_t required = {};
+    int64_t required_min_offset = 0, required_max_offset = 0;
+    for (int64_t i = 1, min_offset = 0, max_offset = 0; i < num_pats; i++) {
+        min_offset = saturating_add(min_offset, saturating_mul(pats[i - 1].min, min_pat_length(pats[i - 1])));
+        max_offset = saturating_add(max_offset, saturating_mul(pats[i - 1].max, max_pat_length(pats[i - 1])));
+        if (literal_length(pats[i - 1]) > 0 && pats[i - 1].min == pats[i - 1].max) continue;
+        if (literal_length(pats[i]) <= 0) continue;
+        literal_t run = literal_run(pats, num_pats, i);
+        if (run.length > MAX(required.length, prefix.length)) {
+            required = run;
+            required_min_offset = min_offset;
+            required_max_offset = max_offset;
+        }
+    }
+
+    // Only a variable number of repetitions followed by more pattern can
+    // cause backtracking (the last element never backtracks, and neither do
+    // possessive ones):
+    bool can_backtrack = false, has_possessive = false;
+    for (int64_t i = 0; i + 1 < num_pats; i++) {
+        if (pats[i].possessive) has_possessive = true;
+        else if (pats[i].min != pats[i].max) can_backtrack = true;
+    }
+
+    // Whether a match starting at some index runs to the end of the text can
+    // be checked backwards from the end when that's the only way the pattern
+    // can match (it ends with `{end}`), or when there's only one way it can
+    // match from a given index (it can't backtrack). Matching backwards can't
+    // tell how much a possessive repetition would have taken, though:
+    nfa_t *reverse_nfa = NULL;
+    bool ends_anchored = num_pats > 0 && pats[num_pats - 1].tag == PAT_END && !pats[num_pats - 1].negated;
+    if ((ends_anchored || !can_backtrack) && !has_possessive) {
+        int64_t num_reversed = ends_anchored ? num_pats - 1 : num_pats;
+        pat_t *reversed = GC_MALLOC(sizeof(pat_t) * (size_t)MAX(num_reversed, 1));
+        for (int64_t i = 0; i < num_reversed; i++)
+            reversed[i] = pats[num_reversed - 1 - i];
+        reverse_nfa = compile_nfa(reversed, num_reversed);
+    }
+
+    int64_t min_length = 0, max_length = 0;
+    for (int64_t i = 0; i < num_pats; i++) {
+        min_length = saturating_add(min_length, saturating_mul(pats[i].min, min_pat_length(pats[i])));
+        max_length = saturating_add(max_length, saturating_mul(pats[i].max, max_pat_length(pats[i])));
     }
+    bool anchored = num_pats > 0 && pats[0].tag == PAT_START && !pats[0].negated && pats[0].min > 0;
+
+    int64_t program_length, fast_program_length;
+    pat_t *program = optimize_pats(pats, num_pats, true, &program_length);
+    pat_t *fast_program = optimize_pats(pats, num_pats, false, &fast_program_length);
+
+    nfa_t *nfa = compile_nfa(pats, num_pats);
+    dfa_cache_t *dfa_cache = nfa ? new (dfa_cache_t, .lock = PTHREAD_MUTEX_INITIALIZER) : NULL;
+
+    pattern_stats_t *stats = NULL;
+#ifdef PATTERN_STATS
+    stats = GC_MALLOC(sizeof(pattern_stats_t));
+    current_stats = outer_stats;
+#endif
+
+    return new (compiled_pattern_t, .source = pattern, .pats = pats, .num_pats = num_pats,
+                .num_captures = num_captures, .prefix = prefix, .required = required,
+                .required_min_offset = required_min_offset, .required_max_offset = required_max_offset,
+                .can_backtrack = can_backtrack, .nfa = nfa, .dfa_cache = dfa_cache, .reverse_nfa = reverse_nfa,
+                .stats = stats, .program = program, .fast_program = fast_program, .program_length = program_length,
+                .fast_program_length = fast_program_length, .min_length = min_length, .max_length = max_length,
+                .anchored = anchored);
+}
+
+static void cache_unlink(pattern_cache_entry_t *entry) {
+    if (entry->newer) entry->newer->older = entry->older;
+    else pattern_cache.newest = entry->older;
+    if (entry->older) entry->older->newer = entry->newer;
+    else pattern_cache.oldest = entry->newer;
+    entry->newer = entry->older = NULL;
+}
+
+static void cache_push_newest(pattern_cache_entry_t *entry) {
+    entry->older = pattern_cache.newest;
+    entry->newer = NULL;
+    if (pattern_cache.newest) pattern_cache.newest->newer = entry;
+    pattern_cache.newest = entry;
+    if (!pattern_cache.oldest) pattern_cache.oldest = entry;
+}
+
+static void cache_evict_oldest(void) {
+    pattern_cache_entry_t *victim = pattern_cache.oldest;
+    cache_unlink(victim);
+    pattern_cache_entry_t **bucket = &pattern_cache.buckets[victim->hash & (uint64_t)(pattern_cache.num_buckets - 1)];
+    while (*bucket != victim)
+        bucket = &(*bucket)->next_in_bucket;
+    *bucket = victim->next_in_bucket;
+    pattern_cache.size -= 1;
+    pattern_cache.evictions += 1;
+}
+
+static compiled_pattern_t *cache_lookup(Text_t pattern) {
+    if (pattern_cache.capacity <= 0) return compile_pattern(pattern);
+
+    if (!pattern_cache.buckets) {
+        // Power of two, at least twice the capacity, so chains stay short:
+        pattern_cache.num_buckets = 16;
+        while (pattern_cache.num_buckets < 2 * pattern_cache.capacity)
+            pattern_cache.num_buckets *= 2;
+        pattern_cache.buckets = GC_MALLOC(sizeof(pattern_cache_entry_t *) * (size_t)pattern_cache.num_buckets);
+    }
+
+    uint64_t hash = Text$hash(&pattern, &Text$info);
+    pattern_cache_entry_t **bucket = &pattern_cache.buckets[hash & (uint64_t)(pattern_cache.num_buckets - 1)];
+    for (pattern_cache_entry_t *entry = *bucket; entry; entry = entry->next_in_bucket) {
+        if (entry->hash == hash && Text$equal_values(entry->compiled->source, pattern)) {
+            pattern_cache.hits += 1;
+            if (entry != pattern_cache.newest) {
+                cache_unlink(entry);
+                cache_push_newest(entry);
+            }
+            return entry->compiled;
+        }
+    }
+
+    pattern_cache.misses += 1;
+    compiled_pattern_t *compiled = compile_pattern(pattern);
+    if (pattern_cache.size >= pattern_cache.capacity) cache_evict_oldest();
+    pattern_cache_entry_t *entry =
+        new (pattern_cache_entry_t, .hash = hash, .compiled = compiled, .next_in_bucket = *bucket);
+    *bucket = entry;
+    cache_push_newest(entry);
+    pattern_cache.size += 1;
+    return compiled;
+}
+
+static compiled_pattern_t *Pattern$compile(Text_t pattern) {
+    pthread_mutex_lock(&pattern_cache_lock);
+    compiled_pattern_t *compiled = cache_lookup(pattern);
+    pthread_mutex_unlock(&pattern_cache_lock);
+    return compiled;
+}
+
+static void Pattern$cache_stats(PatternCacheStats *dest) {
+    pthread_mutex_lock(&pattern_cache_lock);
+    *dest = (PatternCacheStats){
+        .hits = I(pattern_cache.hits),
+        .misses = I(pattern_cache.misses),
+        .evictions = I(pattern_cache.evictions),
+        .size = I(pattern_cache.size),
+        .capacity = I(pattern_cache.capacity),
+    };
+    pthread_mutex_unlock(&pattern_cache_lock);
+}
+
+static pattern_stats_t load_stats(const compiled_pattern_t *pattern) {
+    if (!pattern->stats) return (pattern_stats_t){};
+    return (pattern_stats_t){
+        .starts = __atomic_load_n(&pattern->stats->starts, __ATOMIC_RELAXED),
+        .recursions = __atomic_load_n(&pattern->stats->recursions, __ATOMIC_RELAXED),
+        .backtracks = __atomic_load_n(&pattern->stats->backtracks, __ATOMIC_RELAXED),
+        .function_calls = __atomic_load_n(&pattern->stats->function_calls, __ATOMIC_RELAXED),
+        .graphemes = __atomic_load_n(&pattern->stats->graphemes, __ATOMIC_RELAXED),
+    };
+}
+
+static void Pattern$stats(compiled_pattern_t *pattern, PatternStats *dest) {
+    pattern_stats_t stats = load_stats(pattern);
+    *dest = (PatternStats){
+        .starts = I(stats.starts),
+        .recursions = I(stats.recursions),
+        .backtracks = I(stats.backtracks),
+        .function_calls = I(stats.function_calls),
+        .graphemes = I(stats.graphemes),
+    };
+}
+
+static void Pattern$dump_stats(void) {
+    // One tab-separated line per cached pattern, most recently used first:
+    printf("starts\trecursions\tbacktracks\tfunction_calls\tgraphemes\tpattern\n");
+    pthread_mutex_lock(&pattern_cache_lock);
+    for (pattern_cache_entry_t *entry = pattern_cache.newest; entry; entry = entry->older) {
+        pattern_stats_t stats = load_stats(entry->compiled);
+        printf("%" PRId64 "\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\t%s\n", stats.starts,
+               stats.recursions, stats.backtracks, stats.function_calls, stats.graphemes,
+               Text$as_c_string(entry->compiled->source));
+    }
+    pthread_mutex_unlock(&pattern_cache_lock);
+    fflush(stdout);
+}
+
+static void Pattern$set_cache_capacity(Int_t capacity) {
+    // Changing the capacity drops all cached patterns and starts counting afresh:
+    int64_t new_capacity = MAX(Int64$from_int(capacity, false), 0);
+    pthread_mutex_lock(&pattern_cache_lock);
+    pattern_cache.capacity = new_capacity;
+    pattern_cache.buckets = NULL;
+    pattern_cache.num_buckets = 0;
+    pattern_cache.newest = pattern_cache.oldest = NULL;
+    pattern_cache.size = 0;
+    pattern_cache.hits = pattern_cache.misses = pattern_cache.evictions = 0;
+    pthread_mutex_unlock(&pattern_cache_lock);
+}
+
+static match_ctx_t new_match_ctx(Text_t text, const compiled_pattern_t *pattern) {
+    // Memoizing failures bounds the work to O(pattern x text), but it's only
+    // worth allocating the memo table for patterns that can backtrack and
+    // only once they have actually done a lot of backtracking:
+    int64_t memo_threshold = -1;
+    if (pattern->can_backtrack && text.length + 1 <= MEMO_MAX_BITS / pattern->num_pats)
+        memo_threshold = MEMO_MIN_CALLS + pattern->num_pats * text.length;
+#ifdef PATTERN_STATS
+    current_stats = pattern->stats;
+#endif
+    return (match_ctx_t){
+        .text_state = NEW_TEXT_ITER_STATE(text),
+        .pattern = pattern,
+        .memo_threshold = memo_threshold,
+        .next_required = -1,
+    };
+}
+
+static capture_t *ctx_captures(match_ctx_t *ctx) {
+    // Room for every capture, plus the whole match when replacing (where
+    // captures are numbered from 1). A successful match writes every slot its
+    // pattern uses and a failed one writes none, so this can be reused for
+    // every match without clearing it:
+    if (!ctx->captures)
+        ctx->captures = GC_MALLOC_ATOMIC(sizeof(capture_t) * (size_t)(ctx->pattern->num_captures + 1));
+    return ctx->captures;
+}
+
+static double monotonic_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + 1e-9 * (double)now.tv_nsec;
+}
+
+static INLINE bool out_of_budget(void) {
+    // Counts one step of the backtracking matcher against the budget, and
+    // looks at the clock every so often:
+    if (!match_budget.limited) return false;
+    if (match_budget.exceeded) return true;
+    match_budget.steps += 1;
+    if (match_budget.max_steps > 0 && match_budget.steps > match_budget.max_steps) match_budget.exceeded = true;
+    else if (match_budget.deadline > 0 && match_budget.steps % BUDGET_CLOCK_INTERVAL == 0
+             && monotonic_seconds() > match_budget.deadline)
+        match_budget.exceeded = true;
+    return match_budget.exceeded;
+}
+
+static void Pattern$begin_budget(Int_t steps, double seconds) {
+    match_budget_t *outer = NULL;
+    if (match_budget.limited) {
+        outer = malloc(sizeof(match_budget_t));
+        if (!outer) fail_text(Text("Out of memory"));
+        *outer = match_budget;
+    }
+    match_budget = (match_budget_t){
+        .limited = true,
+        .max_steps = MAX(Int64$from_int(steps, false), 0),
+        .deadline = seconds > 0 ? monotonic_seconds() + seconds : 0,
+        .outer = outer,
+    };
+}
+
+static bool Pattern$end_budget(void) {
+    // Returns whether the budget ran out since `Pattern$begin_budget()`, and
+    // puts back the budget it replaced, charging it for the steps taken:
+    bool exceeded = match_budget.exceeded;
+    int64_t steps = match_budget.steps;
+    match_budget_t *outer = match_budget.outer;
+    if (outer) {
+        match_budget = *outer;
+        free(outer);
+        match_budget.steps = saturating_add(match_budget.steps, steps);
+        if (match_budget.max_steps > 0 && match_budget.steps > match_budget.max_steps) match_budget.exceeded = true;
+    } else {
+        match_budget = (match_budget_t){};
+    }
+    return exceeded;
+}
+
+static int64_t match(match_ctx_t *ctx, int64_t text_index, int64_t pattern_index, capture_t *captures,
+                     int64_t capture_index) {
+    // Once the budget runs out, every attempt fails straight away so that the
+    // search unwinds quickly:
+    if (out_of_budget()) return -1;
+
+    const compiled_pattern_t *pattern = ctx->pattern;
+    TRACK_STATS(ctx);
+    COUNT_STAT(recursions);
+    if (pattern_index == 0) COUNT_STAT(starts);
+    // Without captures, we can run the shorter program:
+    const pat_t *pats = captures ? pattern->program : pattern->fast_program;
+    int64_t num_pats = captures ? pattern->program_length : pattern->fast_program_length;
+    if (pattern_index >= num_pats) // End of the pattern
+        return 0;
+
+    Text_t text = ctx->text_state.stack[0].text;
+    uint64_t **failures = captures ? &ctx->failures : &ctx->fast_failures;
+    int64_t memo_index = -1;
+    if (ctx->memo_threshold >= 0 && text_index <= text.length) {
+        memo_index = pattern_index * (text.length + 1) + text_index;
+        if (*failures) {
+            if ((*failures)[memo_index / 64] & (1ul << (memo_index % 64))) return -1;
+        } else if (++ctx->calls > ctx->memo_threshold) {
+            int64_t num_bits = num_pats * (text.length + 1);
+            size_t size = sizeof(uint64_t) * (size_t)((num_bits + 63) / 64);
+            *failures = memset(GC_MALLOC_ATOMIC(size), 0, size);
+        }
+    }
+
+    int64_t start_index = text_index;
+    pat_t pat = pats[pattern_index++];
 
     int64_t capture_start = text_index;
     int64_t count = 0, capture_len = 0, next_match_len = 0;
 
-    if (pat.tag == PAT_ANY && pattern_index >= pattern.length) {
+    if (pat.tag == PAT_ANY && pattern_index >= num_pats) {
         int64_t remaining = text.length - text_index;
-        capture_len = remaining >= pat.min ? MIN(remaining, pat.max) : -1;
+        if (remaining < pat.min) goto failure;
+        capture_len = MIN(remaining, pat.max);
         text_index += capture_len;
         goto success;
     }
 
-    if (pat.min == 0 && pattern_index < pattern.length) {
-        next_match_len =
-            match(text, text_index, pattern, pattern_index, captures, capture_index + (pat.non_capturing ? 0 : 1));
+    if (pat.possessive) {
+        // Take every repetition we can, then the rest of the pattern has to
+        // match from there:
+        while (count < pat.max) {
+            int64_t match_len = match_pat(&ctx->text_state, text_index, pat);
+            if (match_len < 0) break;
+            capture_len += match_len;
+            text_index += match_len;
+            count = match_len == 0 ? pat.max : count + 1;
+        }
+        if (count < pat.min) goto failure;
+        next_match_len = match(ctx, text_index, pattern_index, captures, capture_index + (pat.non_capturing ? 0 : 1));
+        if (next_match_len < 0) goto failure;
+        goto success;
+    }
+
+    if (pat.min == 0 && pattern_index < num_pats) {
+        next_match_len = match(ctx, text_index, pattern_index, captures, capture_index + (pat.non_capturing ? 0 : 1));
         if (next_match_len >= 0) {
             capture_len = 0;
             goto success;
@@ -670,17 +1529,18 @@ static int64_t match(Text_t text, int64_t text_index, Text_t pattern, int64_t pa
     }
 
     while (count < pat.max) {
-        int64_t match_len = match_pat(&text_state, text_index, pat);
+        if (match_budget.exceeded) goto failure;
+        int64_t match_len = match_pat(&ctx->text_state, text_index, pat);
         if (match_len < 0) break;
         capture_len += match_len;
         text_index += match_len;
         count += 1;
 
-        if (pattern_index < pattern.length) { // More stuff after this
+        if (pattern_index < num_pats) { // More stuff after this
             if (count < pat.min) next_match_len = -1;
             else
-                next_match_len = match(text, text_index, pattern, pattern_index, captures,
-                                       capture_index + (pat.non_capturing ? 0 : 1));
+                next_match_len =
+                    match(ctx, text_index, pattern_index, captures, capture_index + (pat.non_capturing ? 0 : 1));
         } else {
             next_match_len = 0;
         }
@@ -692,124 +1552,651 @@ static int64_t match(Text_t text, int64_t text_index, Text_t pattern, int64_t pa
                 count = pat.max;
                 break;
             } else {
-                return -1;
+                goto failure;
             }
         }
 
-        if (pattern_index < pattern.length && next_match_len >= 0) break; // Next guy exists and wants to stop here
+        if (pattern_index < num_pats && next_match_len >= 0) break; // Next guy exists and wants to stop here
 
         if (text_index >= text.length) break;
     }
 
-    if (count < pat.min || next_match_len < 0) return -1;
+    if (count < pat.min || next_match_len < 0) goto failure;
 
 success:
-    if (captures && capture_index < MAX_BACKREFS && !pat.non_capturing) {
+    if (captures && !pat.non_capturing) {
         if (pat.tag == PAT_PAIR || pat.tag == PAT_QUOTE) {
             assert(capture_len > 0);
             captures[capture_index] = (capture_t){
                 .index = capture_start + 1, // Skip leading quote/paren
                 .length = capture_len - 2, // Skip open/close
-                .occupied = true,
                 .recursive = (pat.tag == PAT_PAIR),
             };
         } else {
             captures[capture_index] = (capture_t){
                 .index = capture_start,
                 .length = capture_len,
-                .occupied = true,
                 .recursive = false,
             };
         }
     }
     return (text_index - start_index) + next_match_len;
+
+failure:
+    COUNT_STAT(backtracks);
+    // Whether a pattern element matches at a given index doesn't depend on
+    // how we got there, so this never needs to be retried (unless it only
+    // failed because the budget ran out):
+    if (*failures && memo_index >= 0 && !match_budget.exceeded) (*failures)[memo_index / 64] |= (1ul << (memo_index % 64));
+    return -1;
 }
 
 #undef EAT1
 #undef EAT2
 #undef EAT_MANY
 
-static int64_t _find(Text_t text, Text_t pattern, int64_t first, int64_t last, int64_t *match_length,
-                     capture_t *captures) {
-    int32_t first_grapheme = Text$get_grapheme(pattern, 0);
-    bool find_first = (first_grapheme != '{' && !uc_is_property((ucs4_t)first_grapheme, UC_PROPERTY_QUOTATION_MARK)
-                       && !uc_is_property((ucs4_t)first_grapheme, UC_PROPERTY_PAIRED_PUNCTUATION));
+typedef int64_t (*byte_scanner_t)(const char *text, int64_t len, int64_t pos, const char *literal, int64_t m);
 
-    TextIter_t text_state = NEW_TEXT_ITER_STATE(text);
-    for (int64_t i = first; i <= last; i++) {
-        // Optimization: quickly skip ahead to first char in pattern:
-        if (find_first) {
-            while (i < text.length && Text$get_grapheme_fast(&text_state, i) != first_grapheme)
-                ++i;
+static int64_t scan_bytes_scalar(const char *text, int64_t len, int64_t pos, const char *literal, int64_t m) {
+    // Returns the first index at or after `pos` where the `m` bytes of
+    // `literal` occur in `text` (or `len` if there is none):
+    while (pos + m <= len) {
+        const char *found = memchr(text + pos, literal[0], (size_t)(len - m + 1 - pos));
+        if (!found) break;
+        pos = found - text;
+        if (memcmp(text + pos + 1, literal + 1, (size_t)(m - 1)) == 0) return pos;
+        pos += 1;
+    }
+    return len;
+}
+
+#if defined(__x86_64__)
+// These compare the first and last bytes of the literal against a whole block
+// of positions at once, and only check the rest of the literal at positions
+// where both of them agree:
+static int64_t scan_bytes_sse2(const char *text, int64_t len, int64_t pos, const char *literal, int64_t m) {
+    const __m128i first = _mm_set1_epi8(literal[0]), last = _mm_set1_epi8(literal[m - 1]);
+    for (; pos + m - 1 + 16 <= len; pos += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(text + pos));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(text + pos + m - 1));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+        for (; mask; mask &= mask - 1) {
+            int64_t candidate = pos + __builtin_ctz(mask);
+            if (memcmp(text + candidate + 1, literal + 1, (size_t)(m - 1)) == 0) return candidate;
+        }
+    }
+    return scan_bytes_scalar(text, len, pos, literal, m);
+}
+
+__attribute__((target("avx2"))) static int64_t scan_bytes_avx2(const char *text, int64_t len, int64_t pos,
+                                                               const char *literal, int64_t m) {
+    const __m256i first = _mm256_set1_epi8(literal[0]), last = _mm256_set1_epi8(literal[m - 1]);
+    for (; pos + m - 1 + 32 <= len; pos += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)(text + pos));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(text + pos + m - 1));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+        for (; mask; mask &= mask - 1) {
+            int64_t candidate = pos + __builtin_ctz(mask);
+            if (memcmp(text + candidate + 1, literal + 1, (size_t)(m - 1)) == 0) return candidate;
+        }
+    }
+    return scan_bytes_sse2(text, len, pos, literal, m);
+}
+#endif
+
+static byte_scanner_t byte_scanner = NULL;
+
+static void init_byte_scanner(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    byte_scanner = __builtin_cpu_supports("avx2") ? scan_bytes_avx2 : scan_bytes_sse2;
+#else
+    byte_scanner = scan_bytes_scalar;
+#endif
+}
+
+static int64_t scan_bytes(const char *text, int64_t len, int64_t pos, const char *literal, int64_t m) {
+    if (!byte_scanner) init_byte_scanner();
+    return byte_scanner(text, len, pos, literal, m);
+}
+
+static int64_t find_literal(const literal_t *literal, TextIter_t *state, int64_t pos) {
+    // Returns the first index at or after `pos` where the literal occurs (or
+    // the text length if there is none):
+    Text_t text = state->stack[0].text;
+    int64_t len = text.length, m = literal->length;
+    if (m == 0) return pos;
+    if (text.tag == TEXT_ASCII) {
+        if (!literal->bytes || pos >= len) return len;
+        return scan_bytes(text.ascii, len, pos, literal->bytes, m);
+    }
+    if (m == 1) {
+        while (pos < len && grapheme_at(state, pos) != literal->graphemes[0])
+            ++pos;
+        return pos;
+    }
+    while (pos + m <= len) {
+        int32_t last = grapheme_at(state, pos + m - 1);
+        if (last == literal->graphemes[m - 1]) {
+            int64_t i = m - 2;
+            while (i >= 0 && grapheme_at(state, pos + i) == literal->graphemes[i])
+                i--;
+            if (i < 0) return pos;
         }
+        pos += literal->skip[(uint32_t)last & 0xFF];
+    }
+    return len;
+}
+
+static int64_t skip_to_candidate(match_ctx_t *ctx, int64_t pos) {
+    // Returns the first index at or after `pos` where a match could start,
+    // judging by the pattern's literals (or the text length if there is none):
+    TRACK_STATS(ctx);
+    const compiled_pattern_t *pattern = ctx->pattern;
+    int64_t len = ctx->text_state.stack[0].text.length;
+    // Anchored patterns can only start at the start:
+    if (pattern->anchored && pos > 0) return len;
+    for (;;) {
+        pos = find_literal(&pattern->prefix, &ctx->text_state, pos);
+        if (pos >= len || pattern->required.length == 0) return pos;
+
+        // Scans only move forward, so the last occurrence we found is still
+        // the next one as long as it's not behind the window:
+        int64_t window_start = saturating_add(pos, pattern->required_min_offset);
+        if (window_start >= len) return len;
+        if (ctx->next_required < window_start)
+            ctx->next_required = find_literal(&pattern->required, &ctx->text_state, window_start);
+        if (ctx->next_required >= len) return len;
+
+        if (ctx->next_required - pos <= pattern->required_max_offset) return pos;
+        pos = ctx->next_required - pattern->required_max_offset;
+    }
+}
+
+static INLINE bool nfa_element_matches(const pat_t *pat, int32_t grapheme) {
+    switch (pat->tag) {
+    case PAT_ANY: return true;
+    case PAT_GRAPHEME: return (grapheme == pat->grapheme) != pat->negated;
+    case PAT_PROPERTY: return has_property(pat->property, grapheme) != pat->negated;
+    default: return false;
+    }
+}
 
-        int64_t m = match(text, i, pattern, 0, captures, 0);
+static void nfa_add_state(const nfa_t *nfa, uint64_t *set, int64_t pattern_index, int64_t count) {
+    for (;;) {
+        int64_t s = pattern_index >= nfa->num_pats ? nfa->num_states : nfa->base[pattern_index] + count;
+        if (set[s / 64] & (1ul << (s % 64))) return;
+        set[s / 64] |= (1ul << (s % 64));
+        if (pattern_index >= nfa->num_pats || count < nfa->pats[pattern_index].min) return;
+        pattern_index += 1;
+        count = 0;
+    }
+}
+
+static void nfa_step(const nfa_t *nfa, const uint64_t *from, uint64_t *to, int32_t grapheme) {
+    memset(to, 0, sizeof(uint64_t) * (size_t)nfa->num_words);
+    for (int64_t w = 0; w < nfa->num_words; w++) {
+        for (uint64_t bits = from[w]; bits; bits &= bits - 1) {
+            int64_t s = w * 64 + __builtin_ctzll(bits);
+            if (s >= nfa->num_states) continue;
+            int64_t i = nfa->state_pat[s], count = s - nfa->base[i];
+            if (count < nfa->pats[i].max && nfa_element_matches(&nfa->pats[i], grapheme))
+                nfa_add_state(nfa, to, i, MIN(count + 1, nfa->cap[i]));
+        }
+    }
+}
+
+static int64_t match_backward(match_ctx_t *ctx, int64_t first, bool earliest) {
+    // Runs the reversed program from the end of the text back towards `first`
+    // and returns an index where a nonempty match runs to the end of the text:
+    // the earliest such index if `earliest` is set, otherwise the first one
+    // found. Returns -1 if there is none.
+    TRACK_STATS(ctx);
+    const nfa_t *nfa = ctx->pattern->reverse_nfa;
+    size_t set_size = sizeof(uint64_t) * (size_t)nfa->num_words;
+    uint64_t *set = GC_MALLOC_ATOMIC(set_size), *next = GC_MALLOC_ATOMIC(set_size);
+    memset(set, 0, set_size);
+    nfa_add_state(nfa, set, 0, 0);
+    int64_t found = -1;
+    for (int64_t i = ctx->text_state.stack[0].text.length - 1; i >= first; i--) {
+        nfa_step(nfa, set, next, grapheme_at(&ctx->text_state, i));
+        uint64_t *tmp = set;
+        set = next;
+        next = tmp;
+        if (set[nfa->num_states / 64] & (1ul << (nfa->num_states % 64))) {
+            found = i;
+            if (!earliest) break;
+        }
+        // Stop once no partial match could be extended any further:
+        bool alive = false;
+        for (int64_t w = 0; w < nfa->num_words && !alive; w++)
+            alive = set[w] != 0;
+        if (!alive) break;
+    }
+    return found;
+}
+
+static void dfa_clear(const nfa_t *nfa, dfa_t *dfa, int64_t capacity) {
+    dfa->capacity = capacity;
+    dfa->num_states = 0;
+    dfa->states = GC_MALLOC_ATOMIC(sizeof(dfa_state_t) * (size_t)capacity);
+    dfa->sets = GC_MALLOC_ATOMIC(sizeof(uint64_t) * (size_t)(capacity * nfa->num_words));
+    dfa->index = GC_MALLOC_ATOMIC(sizeof(int32_t) * (size_t)(2 * capacity));
+    memset(dfa->index, 0, sizeof(int32_t) * (size_t)(2 * capacity));
+}
+
+static int32_t dfa_state_for(const nfa_t *nfa, dfa_t *dfa, const uint64_t *set) {
+    uint64_t hash = 0xcbf29ce484222325ul;
+    for (int64_t w = 0; w < nfa->num_words; w++)
+        hash = (hash ^ set[w]) * 0x100000001b3ul;
+
+    int64_t index_size = 2 * dfa->capacity;
+    int64_t slot = (int64_t)(hash % (uint64_t)index_size);
+    for (; dfa->index[slot]; slot = (slot + 1) % index_size) {
+        int32_t id = dfa->index[slot] - 1;
+        if (memcmp(&dfa->sets[id * nfa->num_words], set, sizeof(uint64_t) * (size_t)nfa->num_words) == 0) return id;
+    }
+
+    if (dfa->num_states >= dfa->capacity) {
+        // Out of room: either grow the cache, or if it's already as big as
+        // we allow, throw everything away and start building it afresh.
+        dfa_t old = *dfa;
+        if (dfa->capacity < DFA_MAX_STATES) {
+            dfa_clear(nfa, dfa, 2 * dfa->capacity);
+            for (int64_t id = 0; id < old.num_states; id++) {
+                int32_t copy = dfa_state_for(nfa, dfa, &old.sets[id * nfa->num_words]);
+                dfa->states[copy] = old.states[id];
+            }
+        } else {
+            dfa_clear(nfa, dfa, dfa->capacity);
+            dfa->resets += 1;
+        }
+        return dfa_state_for(nfa, dfa, set);
+    }
+
+    int32_t id = (int32_t)dfa->num_states++;
+    memcpy(&dfa->sets[id * nfa->num_words], set, sizeof(uint64_t) * (size_t)nfa->num_words);
+    int64_t accept = nfa->num_states;
+    dfa->states[id].accepting = (set[accept / 64] & (1ul << (accept % 64))) != 0;
+    dfa->states[id].accepting_with_start =
+        dfa->states[id].accepting || (dfa->start_set[accept / 64] & (1ul << (accept % 64))) != 0;
+    dfa->states[id].empty = true;
+    for (int64_t w = 0; w < nfa->num_words; w++)
+        if (set[w]) dfa->states[id].empty = false;
+    memset(dfa->states[id].next, 0xff, sizeof(dfa->states[id].next));
+    dfa->index[slot] = id + 1;
+    return id;
+}
+
+static dfa_t *new_dfa(const nfa_t *nfa) {
+    dfa_t *dfa = new (dfa_t, .start_set = GC_MALLOC_ATOMIC(sizeof(uint64_t) * (size_t)nfa->num_words));
+    memset(dfa->start_set, 0, sizeof(uint64_t) * (size_t)nfa->num_words);
+    nfa_add_state(nfa, dfa->start_set, 0, 0);
+    dfa_clear(nfa, dfa, 16);
+    return dfa;
+}
+
+static bool dfa_scan(match_ctx_t *ctx, dfa_t *dfa) {
+    // Equivalent to `_find()` without captures, but in a single pass over the
+    // text: each DFA state is the set of NFA states reachable from matches
+    // that began at earlier positions.
+    const nfa_t *nfa = ctx->pattern->nfa;
+    TextIter_t *state = &ctx->text_state;
+    Text_t text = state->stack[0].text;
+    uint64_t set[nfa->num_words], next_set[nfa->num_words];
+    memset(set, 0, sizeof(set));
+    int32_t current = dfa_state_for(nfa, dfa, set);
+    for (int64_t i = 0; i < text.length; i++) {
+        if (dfa->states[current].empty) {
+            // No partial matches in progress, so we can skip to the next place
+            // one could start:
+            i = skip_to_candidate(ctx, i);
+            if (i >= text.length) break;
+        }
+        if (dfa->states[current].accepting_with_start) return true;
+        int32_t grapheme = grapheme_at(state, i);
+        bool ascii = (grapheme >= 0 && grapheme < 128);
+        int32_t next = ascii ? dfa->states[current].next[grapheme] : -1;
+        if (next < 0) {
+            for (int64_t w = 0; w < nfa->num_words; w++)
+                set[w] = dfa->sets[current * nfa->num_words + w] | dfa->start_set[w];
+            nfa_step(nfa, set, next_set, grapheme);
+            int64_t resets = dfa->resets;
+            next = dfa_state_for(nfa, dfa, next_set);
+            if (ascii && dfa->resets == resets) dfa->states[current].next[grapheme] = next;
+        }
+        current = next;
+    }
+    return dfa->states[current].accepting;
+}
+
+static bool dfa_has(match_ctx_t *ctx) {
+    // Uses the pattern's DFA if no other thread is using it, and otherwise
+    // builds one for this search rather than waiting:
+    TRACK_STATS(ctx);
+    dfa_cache_t *cache = ctx->pattern->dfa_cache;
+    if (pthread_mutex_trylock(&cache->lock) == 0) {
+        if (!cache->dfa) cache->dfa = new_dfa(ctx->pattern->nfa);
+        bool found = dfa_scan(ctx, cache->dfa);
+        pthread_mutex_unlock(&cache->lock);
+        return found;
+    }
+    if (!ctx->dfa) ctx->dfa = new_dfa(ctx->pattern->nfa);
+    return dfa_scan(ctx, ctx->dfa);
+}
+
+static void nfa_add_thread(const nfa_t *nfa, nfa_thread_t *threads, int64_t *num_threads, int64_t *seen, int64_t step,
+                           int64_t pattern_index, int64_t count, int64_t start) {
+    int64_t s = pattern_index >= nfa->num_pats ? nfa->num_states : nfa->base[pattern_index] + count;
+    if (seen[s] == step) return;
+    seen[s] = step;
+    if (pattern_index >= nfa->num_pats) {
+        threads[(*num_threads)++] = (nfa_thread_t){s, start};
+        return;
+    }
+
+    // Threads are kept in the order the backtracking matcher would try them:
+    // every element but the last stops repeating as soon as it can, and the
+    // last one repeats as many times as it can.
+    const pat_t *pat = &nfa->pats[pattern_index];
+    bool can_stop = count >= pat->min, can_repeat = count < pat->max;
+    if (pattern_index + 1 < nfa->num_pats) {
+        if (can_stop) nfa_add_thread(nfa, threads, num_threads, seen, step, pattern_index + 1, 0, start);
+        if (can_repeat) threads[(*num_threads)++] = (nfa_thread_t){s, start};
+    } else {
+        if (can_repeat) threads[(*num_threads)++] = (nfa_thread_t){s, start};
+        if (can_stop) nfa_add_thread(nfa, threads, num_threads, seen, step, pattern_index + 1, 0, start);
+    }
+}
+
+static int64_t nfa_find(match_ctx_t *ctx, int64_t first, int64_t last, int64_t *match_length) {
+    // A Pike VM: this finds the same match as `_find()` would (the leftmost
+    // one, with the length the backtracking matcher would pick) in a single
+    // pass over the text.
+    TRACK_STATS(ctx);
+    const nfa_t *nfa = ctx->pattern->nfa;
+    TextIter_t *state = &ctx->text_state;
+    int64_t found = -1, found_len = -1;
+    first = skip_to_candidate(ctx, first);
+    if (first > last) goto done;
+
+    Text_t text = state->stack[0].text;
+    int64_t max_threads = nfa->num_states + 1;
+    if (!ctx->nfa_threads) {
+        ctx->nfa_threads = GC_MALLOC_ATOMIC(sizeof(nfa_thread_t) * (size_t)(2 * max_threads));
+        ctx->nfa_seen = GC_MALLOC_ATOMIC(sizeof(int64_t) * (size_t)max_threads);
+        memset(ctx->nfa_seen, 0xff, sizeof(int64_t) * (size_t)max_threads);
+    }
+    nfa_thread_t *threads = ctx->nfa_threads, *next_threads = threads + max_threads;
+    int64_t *seen = ctx->nfa_seen;
+
+    int64_t num_threads = 0, step = ctx->nfa_step;
+    nfa_add_thread(nfa, threads, &num_threads, seen, step, 0, 0, first);
+    for (int64_t i = first; num_threads > 0; i++) {
+        int32_t grapheme = i < text.length ? grapheme_at(state, i) : 0;
+        int64_t num_next = 0;
+        step += 1;
+        for (int64_t t = 0; t < num_threads; t++) {
+            int64_t s = threads[t].state;
+            if (s == nfa->num_states) {
+                // Anything after this thread has lower priority:
+                found = threads[t].start;
+                found_len = i - found;
+                break;
+            }
+            if (i >= text.length) continue;
+            int64_t p = nfa->state_pat[s];
+            if (nfa_element_matches(&nfa->pats[p], grapheme))
+                nfa_add_thread(nfa, next_threads, &num_next, seen, step, p, MIN(s - nfa->base[p] + 1, nfa->cap[p]),
+                               threads[t].start);
+        }
+        if (i >= text.length) break;
+        if (found < 0 && i + 1 <= last) {
+            int64_t start = i + 1;
+            if (num_next == 0) {
+                start = skip_to_candidate(ctx, start);
+                i = start - 1;
+            }
+            if (start <= last) nfa_add_thread(nfa, next_threads, &num_next, seen, step, 0, 0, start);
+        }
+
+        nfa_thread_t *tmp = threads;
+        threads = next_threads;
+        next_threads = tmp;
+        num_threads = num_next;
+    }
+    ctx->nfa_step = step + 1;
+
+done:
+    if (match_length) *match_length = found_len;
+    return found;
+}
+
+static int64_t _find(match_ctx_t *ctx, int64_t first, int64_t last, int64_t *match_length, capture_t *captures) {
+    TRACK_STATS(ctx);
+    // Matches need enough text left after where they start, and anchored
+    // ones can only start at the start:
+    last = MIN(last, ctx->text_state.stack[0].text.length - ctx->pattern->min_length);
+    if (ctx->pattern->anchored) last = MIN(last, 0);
+    if (!captures && ctx->pattern->nfa) return nfa_find(ctx, first, last, match_length);
+
+    for (int64_t i = first; i <= last; i++) {
+        // Optimization: quickly skip ahead to where the pattern could start:
+        i = skip_to_candidate(ctx, i);
+        if (i > last) break;
+
+        int64_t m = match(ctx, i, 0, captures, 0);
         if (m >= 0) {
             if (match_length) *match_length = m;
             return i;
+        } else if (match_budget.exceeded) {
+            break;
         }
     }
     if (match_length) *match_length = -1;
     return -1;
 }
 
-static OptionalPatternMatch find(Text_t text, Text_t pattern, Int_t from_index) {
+static PatternMatch match_result(match_ctx_t *ctx, int64_t found, int64_t len, capture_t *captures) {
+    Text_t text = ctx->text_state.stack[0].text;
+    List_t capture_list = {};
+    for (int64_t i = 0; i < ctx->pattern->num_captures; i++) {
+        Text_t capture = Text$slice(text, I(captures[i].index + 1), I(captures[i].index + captures[i].length));
+        List$insert(&capture_list, &capture, I(0), sizeof(Text_t));
+    }
+    return (PatternMatch){
+        .text = Text$slice(text, I(found + 1), I(found + len)),
+        .index = I(found + 1),
+        .captures = capture_list,
+    };
+}
+
+static OptionalPatternMatch find(match_ctx_t *ctx, Int_t from_index) {
+    Text_t text = ctx->text_state.stack[0].text;
     int64_t first = Int64$from_int(from_index, false);
     if (first == 0) fail_text(Text("Invalid index: 0"));
     if (first < 0) first = text.length + first + 1;
     if (first > text.length || first < 1) return NONE_MATCH;
 
-    capture_t captures[MAX_BACKREFS] = {};
+    capture_t *captures = ctx_captures(ctx);
     int64_t len = 0;
-    int64_t found = _find(text, pattern, first - 1, text.length - 1, &len, captures);
+    int64_t found = _find(ctx, first - 1, text.length - 1, &len, captures);
     if (found == -1) return NONE_MATCH;
+    PatternMatch m = match_result(ctx, found, len, captures);
+    return (OptionalPatternMatch){.text = m.text, .index = m.index, .captures = m.captures};
+}
 
-    List_t capture_list = {};
-    for (int i = 0; captures[i].occupied; i++) {
-        Text_t capture = Text$slice(text, I(captures[i].index + 1), I(captures[i].index + captures[i].length));
-        List$insert(&capture_list, &capture, I(0), sizeof(Text_t));
+// A share of a parallel search: either the matches that start in
+// `[start, end)` of one text, or the texts in `[start, end)` of a list of
+// texts. Each job is searched on its own thread with its own match context:
+typedef struct parallel_job_s {
+    void (*work)(struct parallel_job_s *job);
+    compiled_pattern_t *pattern;
+    Text_t text;
+    List_t texts;
+    int64_t start, end;
+    bool *done; // Set by any job to stop the others early
+    bool found, zero_length, spans_only;
+    List_t spans, matches; // Matches are only kept if `spans_only` isn't set
+    void *results; // One result per text, stored at the text's index
+} parallel_job_t;
+
+static int64_t parallel_thread_count(Text_t text, Int_t threads) {
+    // A thread count of 0 means to use every core once the text is big enough
+    // for it to be worthwhile:
+    int64_t n = Int64$from_int(threads, false);
+    if (n == 0) n = text.length < PARALLEL_MIN_LENGTH ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
+    return MAX(1, MIN(MIN(n, PARALLEL_MAX_THREADS), text.length));
+}
+
+static void *parallel_worker(void *arg) {
+    parallel_job_t *job = arg;
+    struct GC_stack_base stack_base;
+    GC_get_stack_base(&stack_base);
+    GC_register_my_thread(&stack_base);
+    job->work(job);
+    GC_unregister_my_thread();
+    return NULL;
+}
+
+static parallel_job_t *run_parallel(parallel_job_t job, int64_t count, int64_t num_jobs) {
+    // Splits `[0, count)` evenly into `num_jobs` copies of the given job:
+    static bool threads_allowed = false;
+    if (!threads_allowed) {
+        GC_allow_register_threads();
+        threads_allowed = true;
+    }
+    // Shared tables that are otherwise filled in lazily:
+    if (!char_classes_ready) init_char_classes();
+    if (!byte_scanner) init_byte_scanner();
+
+    job.done = GC_MALLOC_ATOMIC(sizeof(bool));
+    *job.done = false;
+    parallel_job_t *jobs = GC_MALLOC(sizeof(parallel_job_t) * (size_t)num_jobs);
+    for (int64_t k = 0; k < num_jobs; k++) {
+        jobs[k] = job;
+        jobs[k].start = count * k / num_jobs;
+        jobs[k].end = count * (k + 1) / num_jobs;
+    }
+
+    // The calling thread takes the first job, and any job that can't get a
+    // thread of its own is done on the calling thread too:
+    pthread_t threads[PARALLEL_MAX_THREADS];
+    bool started[PARALLEL_MAX_THREADS] = {};
+    for (int64_t k = 1; k < num_jobs; k++)
+        started[k] = pthread_create(&threads[k], NULL, parallel_worker, &jobs[k]) == 0;
+    for (int64_t k = 0; k < num_jobs; k++) {
+        if (k == 0 || !started[k]) job.work(&jobs[k]);
+    }
+    for (int64_t k = 1; k < num_jobs; k++) {
+        if (started[k]) pthread_join(threads[k], NULL);
+    }
+    return jobs;
+}
+
+static void has_job(parallel_job_t *job) {
+    // Searches a piece at a time, so it can stop once another job finds a match:
+    match_ctx_t ctx = new_match_ctx(job->text, job->pattern);
+    for (int64_t pos = job->start; pos < job->end; pos += PARALLEL_PIECE_LENGTH) {
+        if (__atomic_load_n(job->done, __ATOMIC_RELAXED)) return;
+        int64_t last = MIN(pos + PARALLEL_PIECE_LENGTH, job->end) - 1;
+        if (_find(&ctx, pos, last, NULL, NULL) >= 0) {
+            job->found = true;
+            __atomic_store_n(job->done, true, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+}
+
+static void add_span(List_t *spans, List_t *matches, match_ctx_t *ctx, int64_t found, int64_t len,
+                     capture_t *captures) {
+    span_t span = {.start = found, .length = len};
+    List$insert(spans, &span, I_small(0), sizeof(span_t));
+    if (captures) {
+        PatternMatch m = match_result(ctx, found, len, captures);
+        List$insert(matches, &m, I_small(0), sizeof(PatternMatch));
+    }
+}
+
+static void find_all_job(parallel_job_t *job) {
+    match_ctx_t ctx = new_match_ctx(job->text, job->pattern);
+    capture_t *captures = job->spans_only ? NULL : ctx_captures(&ctx);
+    for (int64_t pos = job->start; pos < job->end;) {
+        int64_t len = 0;
+        int64_t found = _find(&ctx, pos, job->end - 1, &len, captures);
+        if (found < 0) break;
+        if (len == 0) {
+            // Leave zero-length matches to the serial search:
+            job->zero_length = true;
+            return;
+        }
+        add_span(&job->spans, &job->matches, &ctx, found, len, captures);
+        pos = found + len;
     }
-    return (OptionalPatternMatch){
-        .text = Text$slice(text, I(found + 1), I(found + len)),
-        .index = I(found + 1),
-        .captures = capture_list,
-    };
 }
 
-PUREFUNC static bool Pattern$has(Text_t text, Text_t pattern) {
-    if (pattern.length == 0) {
+static bool ctx_has(match_ctx_t *ctx, Int_t threads) {
+    TRACK_STATS(ctx);
+    Text_t text = ctx->text_state.stack[0].text;
+    compiled_pattern_t *pattern = (compiled_pattern_t *)ctx->pattern;
+    if (pattern->num_pats == 0) {
         return true;
-    } else if (Text$starts_with(pattern, Text("{start}"), &pattern)) {
-        int64_t m = match(text, 0, pattern, 0, NULL, 0);
+    } else if (text.length < pattern->min_length) {
+        return false;
+    } else if ((pattern->prefix.length > 0 || pattern->required.length > 0)
+               && skip_to_candidate(ctx, 0) >= text.length) {
+        // The pattern's literals don't appear anywhere they'd need to:
+        return false;
+    } else if (pattern->anchored) {
+        int64_t m = match(ctx, 0, 0, NULL, 0);
         return m >= 0;
-    } else if (Text$ends_with(text, Text("{end}"), NULL)) {
-        for (int64_t i = text.length - 1; i >= 0; i--) {
-            int64_t match_len = match(text, i, pattern, 0, NULL, 0);
+    } else if (pattern->pats[pattern->num_pats - 1].tag == PAT_END && !pattern->pats[pattern->num_pats - 1].negated) {
+        if (pattern->reverse_nfa) return match_backward(ctx, 0, false) >= 0;
+        // Matches that start too far back can't reach the end:
+        int64_t earliest = MAX(0, text.length - pattern->max_length);
+        for (int64_t i = text.length - 1; i >= earliest; i--) {
+            int64_t match_len = match(ctx, i, 0, NULL, 0);
             if (match_len >= 0 && i + match_len == text.length) return true;
         }
         return false;
+    } else if (parallel_thread_count(text, threads) > 1) {
+        parallel_job_t *jobs = run_parallel((parallel_job_t){.work = has_job, .pattern = pattern, .text = text},
+                                            text.length, parallel_thread_count(text, threads));
+        return *jobs[0].done;
+    } else if (pattern->nfa) {
+        return dfa_has(ctx);
     } else {
-        int64_t found = _find(text, pattern, 0, text.length - 1, NULL, NULL);
+        int64_t found = _find(ctx, 0, text.length - 1, NULL, NULL);
         return (found >= 0);
     }
 }
 
-static bool Pattern$matches(Text_t text, Text_t pattern) {
-    if (pattern.length == 0) return true;
-    capture_t captures[MAX_BACKREFS] = {};
-    int64_t match_len = match(text, 0, pattern, 0, NULL, 0);
+static bool Pattern$has(Text_t text, compiled_pattern_t *pattern, Int_t threads) {
+    match_ctx_t ctx = new_match_ctx(text, pattern);
+    return ctx_has(&ctx, threads);
+}
+
+static bool Pattern$matches(Text_t text, compiled_pattern_t *pattern) {
+    if (pattern->num_pats == 0) return true;
+    match_ctx_t ctx = new_match_ctx(text, pattern);
+    int64_t match_len;
+    if (pattern->nfa) nfa_find(&ctx, 0, 0, &match_len);
+    else match_len = match(&ctx, 0, 0, NULL, 0);
     return (match_len == text.length);
 }
 
-static bool Pattern$match_at(Text_t text, Text_t pattern, Int_t pos, PatternMatch *dest) {
-    if (pattern.length == 0) return true;
+static bool Pattern$match_at(Text_t text, compiled_pattern_t *pattern, Int_t pos, PatternMatch *dest) {
+    if (pattern->num_pats == 0) return true;
     int64_t start = Int64$from_int(pos, false) - 1;
-    capture_t captures[MAX_BACKREFS] = {};
-    int64_t match_len = match(text, start, pattern, 0, captures, 0);
+    match_ctx_t ctx = new_match_ctx(text, pattern);
+    capture_t *captures = ctx_captures(&ctx);
+    int64_t match_len = match(&ctx, start, 0, captures, 0);
     if (match_len < 0) return false;
 
     List_t capture_list = {};
-    for (int i = 0; captures[i].occupied; i++) {
+    for (int64_t i = 0; i < pattern->num_captures; i++) {
         Text_t capture = Text$slice(text, I(captures[i].index + 1), I(captures[i].index + captures[i].length));
         List$insert(&capture_list, &capture, I(0), sizeof(Text_t));
     }
@@ -819,27 +2206,108 @@ static bool Pattern$match_at(Text_t text, Text_t pattern, Int_t pos, PatternMatc
     return true;
 }
 
-static OptionalList_t Pattern$captures(Text_t text, Text_t pattern) {
-    if (pattern.length == 0) return EMPTY_LIST;
-    capture_t captures[MAX_BACKREFS] = {};
-    int64_t match_len = match(text, 0, pattern, 0, captures, 0);
+static OptionalList_t Pattern$captures(Text_t text, compiled_pattern_t *pattern) {
+    if (pattern->num_pats == 0) return EMPTY_LIST;
+    match_ctx_t ctx = new_match_ctx(text, pattern);
+    capture_t *captures = ctx_captures(&ctx);
+    int64_t match_len = match(&ctx, 0, 0, captures, 0);
     if (match_len != text.length) return NONE_LIST;
 
     List_t capture_list = {};
-    for (int i = 0; captures[i].occupied; i++) {
+    for (int64_t i = 0; i < pattern->num_captures; i++) {
         Text_t capture = Text$slice(text, I(captures[i].index + 1), I(captures[i].index + captures[i].length));
         List$insert(&capture_list, &capture, I(0), sizeof(Text_t));
     }
     return capture_list;
 }
 
-static List_t Pattern$find_all(Text_t text, Text_t pattern) {
-    if (text.length == 0 || pattern.length == 0) // special case
+static INLINE span_t *job_span(parallel_job_t *job, int64_t j) {
+    return (span_t *)(job->spans.data + j * job->spans.stride);
+}
+
+static INLINE int64_t job_match_start(parallel_job_t *job, int64_t j) {
+    return job_span(job, j)->start;
+}
+
+static INLINE int64_t job_match_end(parallel_job_t *job, int64_t j) {
+    return job_span(job, j)->start + job_span(job, j)->length;
+}
+
+static bool find_all_parallel(Text_t text, compiled_pattern_t *pattern, int64_t num_jobs, bool spans_only,
+                              List_t *spans, List_t *matches) {
+    // Finds the same matches as a serial search into `spans` (and `matches`,
+    // unless `spans_only` is set), or returns false if it runs into a
+    // zero-length match, which is left to the serial search.
+    parallel_job_t *jobs = run_parallel(
+        (parallel_job_t){.work = find_all_job, .pattern = pattern, .text = text, .spans_only = spans_only},
+        text.length, num_jobs);
+    for (int64_t k = 0; k < num_jobs; k++) {
+        if (jobs[k].zero_length) return false;
+    }
+
+    // Each job searched its share as if a match ended right where the share
+    // starts. The serial search may instead arrive partway through one of the
+    // job's matches, in which case we search from there ourselves until we
+    // land on one of the job's matches again (after that, both searches make
+    // the same choices):
+    match_ctx_t ctx = new_match_ctx(text, pattern);
+    capture_t *captures = spans_only ? NULL : ctx_captures(&ctx);
+    int64_t pos = 0;
+    for (int64_t k = 0, j = 0; k < num_jobs;) {
+        parallel_job_t *job = &jobs[k];
+        if (pos >= job->end) {
+            k += 1;
+            j = 0;
+            continue;
+        }
+        while (j < job->spans.length && job_match_start(job, j) < pos)
+            j += 1;
+
+        if (j == 0 || pos >= job_match_end(job, j - 1)) {
+            // The job searched every position from here to its next match:
+            if (j >= job->spans.length) {
+                pos = job->end;
+                continue;
+            }
+            List$insert(spans, job_span(job, j), I_small(0), sizeof(span_t));
+            if (!spans_only)
+                List$insert(matches, job->matches.data + j * job->matches.stride, I_small(0), sizeof(PatternMatch));
+            pos = job_match_end(job, j);
+            j += 1;
+            continue;
+        }
+
+        int64_t len = 0;
+        int64_t found = _find(&ctx, pos, job->end - 1, &len, captures);
+        if (found < 0) {
+            pos = job->end;
+        } else if (j < job->spans.length && found == job_match_start(job, j)) {
+            pos = found;
+        } else if (len == 0) {
+            return false;
+        } else {
+            add_span(spans, matches, &ctx, found, len, captures);
+            pos = found + len;
+        }
+    }
+    return true;
+}
+
+static List_t Pattern$find_all(Text_t text, compiled_pattern_t *pattern, Int_t threads) {
+    if (text.length == 0 || pattern->num_pats == 0) // special case
         return EMPTY_LIST;
 
+    // Anchored patterns only have one place to look, so there's nothing to split up:
+    int64_t num_jobs = pattern->anchored ? 1 : parallel_thread_count(text, threads);
+    if (num_jobs > 1) {
+        List_t spans = {}, matches = {};
+        if (find_all_parallel(text, pattern, num_jobs, false, &spans, &matches)) return matches;
+    }
+
+    match_ctx_t ctx = new_match_ctx(text, pattern);
     List_t matches = {};
     for (int64_t i = 1;;) {
-        OptionalPatternMatch m = find(text, pattern, I(i));
+        OptionalPatternMatch m = find(&ctx, I(i));
         if (m.is_none) break;
         i = Int64$from_int(m.index, false) + m.text.length;
         List$insert(&matches, &m, I_small(0), sizeof(PatternMatch));
@@ -847,26 +2315,139 @@ static List_t Pattern$find_all(Text_t text, Text_t pattern) {
     return matches;
 }
 
+static int64_t find_spans(Text_t text, compiled_pattern_t *pattern, Int_t threads, List_t *spans) {
+    // Finds the same matches as `Pattern$find_all()`, but without captures, so
+    // the capture-free search can be used and no text is sliced. Zero-length
+    // matches are kept and the search moves on by one character after them.
+    // The spans are only kept if `spans` isn't NULL:
+    if (text.length == 0 || pattern->num_pats == 0) return 0;
+
+    // Anchored patterns only have one place to look, so there's nothing to split up:
+    int64_t num_jobs = pattern->anchored ? 1 : parallel_thread_count(text, threads);
+    if (num_jobs > 1) {
+        List_t found = {};
+        if (find_all_parallel(text, pattern, num_jobs, true, &found, NULL)) {
+            if (spans) *spans = found;
+            return found.length;
+        }
+    }
+
+    match_ctx_t ctx = new_match_ctx(text, pattern);
+    int64_t count = 0;
+    for (int64_t pos = 0; pos < text.length; count++) {
+        int64_t len = 0;
+        int64_t found = _find(&ctx, pos, text.length - 1, &len, NULL);
+        if (found < 0) break;
+        if (spans) add_span(spans, NULL, &ctx, found, len, NULL);
+        pos = found + MAX(len, 1);
+    }
+    return count;
+}
+
+static Int_t Pattern$count(Text_t text, compiled_pattern_t *pattern, Int_t threads) {
+    return I(find_spans(text, pattern, threads, NULL));
+}
+
+static List_t Pattern$spans(Text_t text, compiled_pattern_t *pattern, Int_t threads) {
+    List_t found = {};
+    find_spans(text, pattern, threads, &found);
+    if (found.length == 0) return EMPTY_LIST;
+    PatternSpan *spans = GC_MALLOC(sizeof(PatternSpan) * (size_t)found.length);
+    for (int64_t i = 0; i < found.length; i++) {
+        span_t *span = (span_t *)(found.data + i * found.stride);
+        spans[i] = (PatternSpan){.start = I(span->start + 1), .len = I(span->length)};
+    }
+    return (List_t){.data = spans, .length = found.length, .stride = sizeof(PatternSpan)};
+}
+
+static int64_t batch_thread_count(List_t texts, Int_t threads) {
+    // Like `parallel_thread_count()`, but going by the total size of the texts:
+    int64_t n = Int64$from_int(threads, false);
+    if (n == 0) {
+        int64_t total = 0;
+        for (int64_t i = 0; i < texts.length && total < PARALLEL_MIN_LENGTH; i++)
+            total += ((Text_t *)(texts.data + i * texts.stride))->length;
+        n = total < PARALLEL_MIN_LENGTH ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    return MAX(1, MIN(MIN(n, PARALLEL_MAX_THREADS), texts.length));
+}
+
+static INLINE Text_t job_text(parallel_job_t *job, int64_t i) {
+    return *(Text_t *)(job->texts.data + i * job->texts.stride);
+}
+
+static void has_each_job(parallel_job_t *job) {
+    for (int64_t i = job->start; i < job->end; i++) {
+        match_ctx_t ctx = new_match_ctx(job_text(job, i), job->pattern);
+        ((bool *)job->results)[i] = ctx_has(&ctx, I_small(1));
+    }
+}
+
+static void captures_each_job(parallel_job_t *job) {
+    for (int64_t i = job->start; i < job->end; i++)
+        ((OptionalList_t *)job->results)[i] = Pattern$captures(job_text(job, i), job->pattern);
+}
+
+static void find_all_each_job(parallel_job_t *job) {
+    for (int64_t i = job->start; i < job->end; i++)
+        ((List_t *)job->results)[i] = Pattern$find_all(job_text(job, i), job->pattern, I_small(1));
+}
+
+static List_t run_batch(List_t texts, compiled_pattern_t *pattern, Int_t threads, void (*work)(parallel_job_t *job),
+                        void *results, size_t result_size) {
+    // Each text's result goes straight into its slot in `results`, so the
+    // order is kept no matter which thread handles which text:
+    parallel_job_t job = {.work = work, .pattern = pattern, .texts = texts, .results = results, .end = texts.length};
+    int64_t num_jobs = batch_thread_count(texts, threads);
+    if (num_jobs > 1) run_parallel(job, texts.length, num_jobs);
+    else work(&job);
+    return (List_t){.data = results, .length = texts.length, .stride = (int64_t)result_size};
+}
+
+static List_t Pattern$has_each(List_t texts, compiled_pattern_t *pattern, Int_t threads) {
+    bool *results = GC_MALLOC_ATOMIC(sizeof(bool) * (size_t)MAX(texts.length, 1));
+    return run_batch(texts, pattern, threads, has_each_job, results, sizeof(bool));
+}
+
+static List_t Pattern$captures_each(List_t texts, compiled_pattern_t *pattern, Int_t threads) {
+    OptionalList_t *results = GC_MALLOC(sizeof(OptionalList_t) * (size_t)MAX(texts.length, 1));
+    return run_batch(texts, pattern, threads, captures_each_job, results, sizeof(OptionalList_t));
+}
+
+static List_t Pattern$find_all_each(List_t texts, compiled_pattern_t *pattern, Int_t threads) {
+    List_t *results = GC_MALLOC(sizeof(List_t) * (size_t)MAX(texts.length, 1));
+    return run_batch(texts, pattern, threads, find_all_each_job, results, sizeof(List_t));
+}
+
+// Iterators keep their match context (with its text iterator, capture buffer,
+// Pike VM scratch space and search caches) from one step to the next, and
+// always search through the context they keep (never a copy), so a step only
+// allocates what it returns:
 typedef struct {
-    TextIter_t state;
-    Int_t i;
-    Text_t pattern;
+    match_ctx_t ctx;
+    int64_t i;
 } match_iter_state_t;
 
 static OptionalPatternMatch next_match(match_iter_state_t *state) {
-    if (Int64$from_int(state->i, false) > state->state.stack[0].text.length) return NONE_MATCH;
+    Text_t text = state->ctx.text_state.stack[0].text;
+    if (state->i >= text.length) return NONE_MATCH;
 
-    OptionalPatternMatch m = find(state->state.stack[0].text, state->pattern, state->i);
-    if (m.is_none) // No match
-        state->i = I(state->state.stack[0].text.length + 1);
-    else state->i = Int$plus(m.index, I(MAX(1, m.text.length)));
-    return m;
+    capture_t *captures = ctx_captures(&state->ctx);
+    int64_t len = 0;
+    int64_t found = _find(&state->ctx, state->i, text.length - 1, &len, captures);
+    if (found < 0) { // No match
+        state->i = text.length;
+        return NONE_MATCH;
+    }
+    state->i = found + MAX(1, len);
+    PatternMatch m = match_result(&state->ctx, found, len, captures);
+    return (OptionalPatternMatch){.text = m.text, .index = m.index, .captures = m.captures};
 }
 
-static Closure_t Pattern$by_match(Text_t text, Text_t pattern) {
+static Closure_t Pattern$by_match(Text_t text, compiled_pattern_t *pattern) {
     return (Closure_t){
         .fn = (void *)next_match,
-        .userdata = new (match_iter_state_t, .state = NEW_TEXT_ITER_STATE(text), .i = I_small(1), .pattern = pattern),
+        .userdata = new (match_iter_state_t, .ctx = new_match_ctx(text, pattern), .i = 0),
     };
 }
 
@@ -877,17 +2458,93 @@ static bool substring_match_at(TextIter_t *haystack, TextIter_t *needle, int64_t
     return true;
 }
 
-static Text_t apply_backrefs(Text_t text, List_t recursive_replacements, Text_t replacement, Text_t backref_marker,
-                             capture_t *captures) {
+// Collects pieces of text to be joined together all at once at the end,
+// instead of building up a deeply nested concatenation one piece at a time:
+typedef struct {
+    List_t pieces;
+} text_builder_t;
+
+static INLINE void add_text(text_builder_t *builder, Text_t text) {
+    if (text.length > 0) List$insert(&builder->pieces, &text, I(0), sizeof(Text_t));
+}
+
+static INLINE Text_t finish_text(text_builder_t *builder) { return Text$join(EMPTY_TEXT, builder->pieces); }
+
+static INLINE uint64_t trie_slot(int64_t node, int32_t grapheme) {
+    return ((uint64_t)node * 0x9E3779B97F4A7C15ul) ^ (uint32_t)grapheme;
+}
+
+static int64_t trie_child(const replacement_set_t *set, int64_t node, int32_t grapheme) {
+    // Returns the child node, or -1 if there's no such edge:
+    if (set->num_edge_slots == 0) return -1;
+    for (uint64_t slot = trie_slot(node, grapheme);; slot++) {
+        trie_edge_t *edge = &set->edges[slot & (uint64_t)(set->num_edge_slots - 1)];
+        if (edge->child == 0) return -1;
+        if (edge->node == node && edge->grapheme == grapheme) return edge->child;
+    }
+}
+
+static replacement_set_t *new_replacement_set(replacement_t *entries, int64_t length) {
+    replacement_set_t *set = new (replacement_set_t, .entries = entries, .length = length);
+    int64_t num_edges = 0;
+    for (int64_t i = 0; i < length; i++)
+        num_edges += entries[i].pattern->prefix.length;
+    if (num_edges > 0) {
+        set->num_edge_slots = 16;
+        while (set->num_edge_slots < 2 * num_edges)
+            set->num_edge_slots *= 2;
+        set->edges = GC_MALLOC_ATOMIC(sizeof(trie_edge_t) * (size_t)set->num_edge_slots);
+        memset(set->edges, 0, sizeof(trie_edge_t) * (size_t)set->num_edge_slots);
+    }
+    set->node_entries = GC_MALLOC_ATOMIC(sizeof(int64_t) * (size_t)(num_edges + 1));
+    memset(set->node_entries, 0xff, sizeof(int64_t) * (size_t)(num_edges + 1));
+    set->next_in_node = GC_MALLOC_ATOMIC(sizeof(int64_t) * (size_t)MAX(length, 1));
+    set->wildcards = GC_MALLOC_ATOMIC(sizeof(int64_t) * (size_t)MAX(length, 1));
+
+    int64_t num_nodes = 1;
+    int64_t *node_tails = GC_MALLOC_ATOMIC(sizeof(int64_t) * (size_t)(num_edges + 1));
+    for (int64_t i = 0; i < length; i++) {
+        set->next_in_node[i] = -1;
+        const literal_t *prefix = &entries[i].pattern->prefix;
+        if (prefix->length == 0) {
+            set->wildcards[set->num_wildcards++] = i;
+            continue;
+        }
+        int64_t node = 0;
+        for (int64_t depth = 0; depth < prefix->length; depth++) {
+            int64_t child = trie_child(set, node, prefix->graphemes[depth]);
+            if (child < 0) {
+                child = num_nodes++;
+                uint64_t slot = trie_slot(node, prefix->graphemes[depth]);
+                while (set->edges[slot & (uint64_t)(set->num_edge_slots - 1)].child != 0)
+                    slot++;
+                set->edges[slot & (uint64_t)(set->num_edge_slots - 1)] =
+                    (trie_edge_t){.node = node, .child = child, .grapheme = prefix->graphemes[depth]};
+            }
+            node = child;
+        }
+        if (set->node_entries[node] < 0) set->node_entries[node] = i;
+        else set->next_in_node[node_tails[node]] = i;
+        node_tails[node] = i;
+    }
+    return set;
+}
+
+static Text_t apply_backrefs(Text_t text, const replacement_set_t *recursive_replacements, Text_t replacement,
+                             Text_t backref_marker, capture_t *captures, int64_t num_captures) {
     if (backref_marker.length == 0) return replacement;
 
-    Text_t ret = Text("");
+    text_builder_t ret = {};
     TextIter_t replacement_state = NEW_TEXT_ITER_STATE(replacement);
     TextIter_t backref_state = NEW_TEXT_ITER_STATE(backref_marker);
     int32_t first_grapheme = Text$get_grapheme_fast(&backref_state, 0);
+    char first_byte = (char)first_grapheme;
+    bool scan_ascii = replacement.tag == TEXT_ASCII && !(first_grapheme & ~0x7F);
     int64_t nonmatching_pos = 0;
     for (int64_t pos = 0; pos < replacement.length;) {
         // Optimization: quickly skip ahead to first char in the backref pattern:
+        if (scan_ascii)
+            pos = MIN(scan_bytes(replacement.ascii, replacement.length, pos, &first_byte, 1), replacement.length - 1);
         while (pos + 1 < replacement.length && Text$get_grapheme_fast(&replacement_state, pos) != first_grapheme)
             ++pos;
 
@@ -901,9 +2558,9 @@ static Text_t apply_backrefs(Text_t text, List_t recursive_replacements, Text_t
         if (substring_match_at(&replacement_state, &backref_state, pos + backref_marker.length)) {
             if (pos > nonmatching_pos) {
                 Text_t before_slice = Text$slice(replacement, I(nonmatching_pos + 1), I(pos));
-                ret = Texts(ret, before_slice);
+                add_text(&ret, before_slice);
             }
-            ret = Texts(ret, backref_marker);
+            add_text(&ret, backref_marker);
             pos += 2 * backref_marker.length;
             nonmatching_pos = pos;
             continue;
@@ -915,10 +2572,7 @@ static Text_t apply_backrefs(Text_t text, List_t recursive_replacements, Text_t
             pos += 1;
             continue;
         }
-        if (backref < 0 || backref >= MAX_BACKREFS)
-            fail_text(Texts("Invalid backref index: ", backref, " (only 0-", MAX_BACKREFS - 1, " are allowed)"));
-
-        if (!captures[backref].occupied) fail_text(Texts("There is no capture number ", backref, "!"));
+        if (backref < 0 || backref >= num_captures) fail_text(Texts("There is no capture number ", backref, "!"));
 
         if (Text$get_grapheme_fast(&replacement_state, after_backref) == ';')
             after_backref += 1; // skip optional semicolon
@@ -926,52 +2580,37 @@ static Text_t apply_backrefs(Text_t text, List_t recursive_replacements, Text_t
         Text_t backref_text =
             Text$slice(text, I(captures[backref].index + 1), I(captures[backref].index + captures[backref].length));
 
-        if (captures[backref].recursive && recursive_replacements.length > 0)
+        if (captures[backref].recursive && recursive_replacements)
             backref_text = replace_list(backref_text, recursive_replacements, backref_marker, true);
 
-        if (pos > nonmatching_pos) {
-            Text_t before_slice = Text$slice(replacement, I(nonmatching_pos + 1), I(pos));
-            ret = Text$concat(ret, before_slice, backref_text);
-        } else {
-            ret = Text$concat(ret, backref_text);
-        }
+        if (pos > nonmatching_pos) add_text(&ret, Text$slice(replacement, I(nonmatching_pos + 1), I(pos)));
+        add_text(&ret, backref_text);
 
         pos = after_backref;
         nonmatching_pos = pos;
     }
     if (nonmatching_pos < replacement.length) {
         Text_t last_slice = Text$slice(replacement, I(nonmatching_pos + 1), I(replacement.length));
-        ret = Text$concat(ret, last_slice);
+        add_text(&ret, last_slice);
     }
-    return ret;
+    return finish_text(&ret);
 }
 
-static Text_t Pattern$replace(Text_t text, Text_t pattern, Text_t replacement, Text_t backref_marker, bool recursive) {
-    if (text.length == 0 || pattern.length == 0) return text;
-    Text_t ret = EMPTY_TEXT;
-
-    int32_t first_grapheme = Text$get_grapheme(pattern, 0);
-    bool find_first = (first_grapheme != '{' && !uc_is_property((ucs4_t)first_grapheme, UC_PROPERTY_QUOTATION_MARK)
-                       && !uc_is_property((ucs4_t)first_grapheme, UC_PROPERTY_PAIRED_PUNCTUATION));
+static Text_t Pattern$replace(Text_t text, compiled_pattern_t *pattern, Text_t replacement, Text_t backref_marker,
+                              bool recursive) {
+    if (text.length == 0 || pattern->num_pats == 0) return text;
+    text_builder_t ret = {};
 
-    Text_t entries[2] = {pattern, replacement};
-    List_t replacements = {
-        .data = entries,
-        .length = 1,
-        .stride = sizeof(entries),
-    };
+    replacement_t entry = {pattern, replacement};
+    replacement_set_t *replacements = recursive ? new_replacement_set(&entry, 1) : NULL;
 
-    TextIter_t text_state = NEW_TEXT_ITER_STATE(text);
+    match_ctx_t ctx = new_match_ctx(text, pattern);
+    capture_t *captures = ctx_captures(&ctx);
     int64_t nonmatching_pos = 0;
     for (int64_t pos = 0; pos < text.length;) {
-        // Optimization: quickly skip ahead to first char in pattern:
-        if (find_first) {
-            while (pos < text.length && Text$get_grapheme_fast(&text_state, pos) != first_grapheme)
-                ++pos;
-        }
+        pos = skip_to_candidate(&ctx, pos);
 
-        capture_t captures[MAX_BACKREFS] = {};
-        int64_t match_len = match(text, pos, pattern, 0, captures, 1);
+        int64_t match_len = match(&ctx, pos, 0, captures, 1);
         if (match_len < 0) {
             pos += 1;
             continue;
@@ -979,66 +2618,57 @@ static Text_t Pattern$replace(Text_t text, Text_t pattern, Text_t replacement, T
         captures[0] = (capture_t){
             .index = pos,
             .length = match_len,
-            .occupied = true,
             .recursive = false,
         };
 
         Text_t replacement_text =
-            apply_backrefs(text, recursive ? replacements : (List_t){}, replacement, backref_marker, captures);
-        if (pos > nonmatching_pos) {
-            Text_t before_slice = Text$slice(text, I(nonmatching_pos + 1), I(pos));
-            ret = Text$concat(ret, before_slice, replacement_text);
-        } else {
-            ret = Text$concat(ret, replacement_text);
-        }
+            apply_backrefs(text, replacements, replacement, backref_marker, captures, pattern->num_captures + 1);
+        if (pos > nonmatching_pos) add_text(&ret, Text$slice(text, I(nonmatching_pos + 1), I(pos)));
+        add_text(&ret, replacement_text);
         nonmatching_pos = pos + match_len;
         pos += MAX(match_len, 1);
     }
     if (nonmatching_pos < text.length) {
         Text_t last_slice = Text$slice(text, I(nonmatching_pos + 1), I(text.length));
-        ret = Text$concat(ret, last_slice);
+        add_text(&ret, last_slice);
     }
-    return ret;
+    return finish_text(&ret);
 }
 
-static Text_t Pattern$trim(Text_t text, Text_t pattern, bool trim_left, bool trim_right) {
-    if (text.length == 0 || pattern.length == 0) return text;
+static Text_t Pattern$trim(Text_t text, compiled_pattern_t *pattern, bool trim_left, bool trim_right) {
+    if (text.length == 0 || pattern->num_pats == 0) return text;
+    match_ctx_t ctx = new_match_ctx(text, pattern);
     int64_t first = 0, last = text.length - 1;
     if (trim_left) {
-        int64_t match_len = match(text, 0, pattern, 0, NULL, 0);
+        int64_t match_len = match(&ctx, 0, 0, NULL, 0);
         if (match_len > 0) first = match_len;
     }
 
-    if (trim_right) {
+    if (trim_right && pattern->reverse_nfa) {
+        int64_t start = match_backward(&ctx, first, true);
+        if (start >= 0) last = start - 1;
+    } else if (trim_right) {
         for (int64_t i = text.length - 1; i >= first; i--) {
-            int64_t match_len = match(text, i, pattern, 0, NULL, 0);
+            int64_t match_len = match(&ctx, i, 0, NULL, 0);
             if (match_len > 0 && i + match_len == text.length) last = i - 1;
         }
     }
     return Text$slice(text, I(first + 1), I(last + 1));
 }
 
-static Text_t Pattern$map(Text_t text, Text_t pattern, Closure_t fn, bool recursive) {
-    if (text.length == 0 || pattern.length == 0) return text;
-    Text_t ret = EMPTY_TEXT;
-
-    int32_t first_grapheme = Text$get_grapheme(pattern, 0);
-    bool find_first = (first_grapheme != '{' && !uc_is_property((ucs4_t)first_grapheme, UC_PROPERTY_QUOTATION_MARK)
-                       && !uc_is_property((ucs4_t)first_grapheme, UC_PROPERTY_PAIRED_PUNCTUATION));
+static Text_t Pattern$map(Text_t text, compiled_pattern_t *pattern, Closure_t fn, bool recursive) {
+    if (text.length == 0 || pattern->num_pats == 0) return text;
+    text_builder_t ret = {};
 
-    TextIter_t text_state = NEW_TEXT_ITER_STATE(text);
+    match_ctx_t ctx = new_match_ctx(text, pattern);
+    capture_t *captures = ctx_captures(&ctx);
     int64_t nonmatching_pos = 0;
 
     Text_t (*text_mapper)(PatternMatch, void *) = fn.fn;
     for (int64_t pos = 0; pos < text.length; pos++) {
-        // Optimization: quickly skip ahead to first char in pattern:
-        if (find_first) {
-            while (pos < text.length && Text$get_grapheme_fast(&text_state, pos) != first_grapheme)
-                ++pos;
-        }
+        pos = skip_to_candidate(&ctx, pos);
 
-        capture_t captures[MAX_BACKREFS] = {};
-        int64_t match_len = match(text, pos, pattern, 0, captures, 0);
+        int64_t match_len = match(&ctx, pos, 0, captures, 0);
         if (match_len < 0) continue;
 
         PatternMatch m = {
@@ -1046,46 +2676,34 @@ static Text_t Pattern$map(Text_t text, Text_t pattern, Closure_t fn, bool recurs
             .index = I(pos + 1),
             .captures = {},
         };
-        for (int i = 0; captures[i].occupied; i++) {
+        for (int64_t i = 0; i < pattern->num_captures; i++) {
             Text_t capture = Text$slice(text, I(captures[i].index + 1), I(captures[i].index + captures[i].length));
             if (recursive) capture = Pattern$map(capture, pattern, fn, recursive);
             List$insert(&m.captures, &capture, I(0), sizeof(Text_t));
         }
 
         Text_t replacement = text_mapper(m, fn.userdata);
-        if (pos > nonmatching_pos) {
-            Text_t before_slice = Text$slice(text, I(nonmatching_pos + 1), I(pos));
-            ret = Text$concat(ret, before_slice, replacement);
-        } else {
-            ret = Text$concat(ret, replacement);
-        }
+        if (pos > nonmatching_pos) add_text(&ret, Text$slice(text, I(nonmatching_pos + 1), I(pos)));
+        add_text(&ret, replacement);
         nonmatching_pos = pos + match_len;
         pos += (match_len - 1);
     }
     if (nonmatching_pos < text.length) {
         Text_t last_slice = Text$slice(text, I(nonmatching_pos + 1), I(text.length));
-        ret = Text$concat(ret, last_slice);
+        add_text(&ret, last_slice);
     }
-    return ret;
+    return finish_text(&ret);
 }
 
-static void Pattern$each(Text_t text, Text_t pattern, Closure_t fn, bool recursive) {
-    if (text.length == 0 || pattern.length == 0) return;
-    int32_t first_grapheme = Text$get_grapheme(pattern, 0);
-    bool find_first = (first_grapheme != '{' && !uc_is_property((ucs4_t)first_grapheme, UC_PROPERTY_QUOTATION_MARK)
-                       && !uc_is_property((ucs4_t)first_grapheme, UC_PROPERTY_PAIRED_PUNCTUATION));
-
-    TextIter_t text_state = NEW_TEXT_ITER_STATE(text);
+static void Pattern$each(Text_t text, compiled_pattern_t *pattern, Closure_t fn, bool recursive) {
+    if (text.length == 0 || pattern->num_pats == 0) return;
+    match_ctx_t ctx = new_match_ctx(text, pattern);
+    capture_t *captures = ctx_captures(&ctx);
     void (*action)(PatternMatch, void *) = fn.fn;
     for (int64_t pos = 0; pos < text.length; pos++) {
-        // Optimization: quickly skip ahead to first char in pattern:
-        if (find_first) {
-            while (pos < text.length && Text$get_grapheme_fast(&text_state, pos) != first_grapheme)
-                ++pos;
-        }
+        pos = skip_to_candidate(&ctx, pos);
 
-        capture_t captures[MAX_BACKREFS] = {};
-        int64_t match_len = match(text, pos, pattern, 0, captures, 0);
+        int64_t match_len = match(&ctx, pos, 0, captures, 0);
         if (match_len < 0) continue;
 
         PatternMatch m = {
@@ -1093,7 +2711,7 @@ static void Pattern$each(Text_t text, Text_t pattern, Closure_t fn, bool recursi
             .index = I(pos + 1),
             .captures = {},
         };
-        for (int i = 0; captures[i].occupied; i++) {
+        for (int64_t i = 0; i < pattern->num_captures; i++) {
             Text_t capture = Text$slice(text, I(captures[i].index + 1), I(captures[i].index + captures[i].length));
             if (recursive) Pattern$each(capture, pattern, fn, recursive);
             List$insert(&m.captures, &capture, I(0), sizeof(Text_t));
@@ -1104,69 +2722,170 @@ static void Pattern$each(Text_t text, Text_t pattern, Closure_t fn, bool recursi
     }
 }
 
-Text_t replace_list(Text_t text, List_t replacements, Text_t backref_marker, bool recursive) {
-    if (text.length == 0 || replacements.length == 0) return text;
+Text_t replace_list(Text_t text, const replacement_set_t *replacements, Text_t backref_marker, bool recursive) {
+    if (text.length == 0 || replacements->length == 0) return text;
 
-    Text_t ret = EMPTY_TEXT;
+    text_builder_t ret = {};
+
+    // Match contexts are only set up for the entries that get tried:
+    match_ctx_t *contexts = GC_MALLOC(sizeof(match_ctx_t) * (size_t)replacements->length);
 
+    TextIter_t state = NEW_TEXT_ITER_STATE(text);
+    int64_t *candidates = GC_MALLOC_ATOMIC(sizeof(int64_t) * (size_t)replacements->length);
     int64_t nonmatch_pos = 0;
     for (int64_t pos = 0; pos < text.length;) {
-        // Find the first matching pattern at this position:
-        for (int64_t i = 0; i < replacements.length; i++) {
-            Text_t pattern = *(Text_t *)(replacements.data + i * replacements.stride);
-            capture_t captures[MAX_BACKREFS] = {};
-            int64_t len = match(text, pos, pattern, 0, captures, 1);
+        // Gather the entries whose literal prefix appears here, in priority order:
+        int64_t num_candidates = 0;
+        for (int64_t depth = 0, node = 0; pos + depth < text.length; depth++) {
+            node = trie_child(replacements, node, Text$get_grapheme_fast(&state, pos + depth));
+            if (node <= 0) break;
+            for (int64_t i = replacements->node_entries[node]; i >= 0; i = replacements->next_in_node[i]) {
+                int64_t j = num_candidates++;
+                for (; j > 0 && candidates[j - 1] > i; j--)
+                    candidates[j] = candidates[j - 1];
+                candidates[j] = i;
+            }
+        }
+
+        // Find the first matching pattern at this position, trying the
+        // candidates and the entries without a prefix in their original order:
+        for (int64_t c = 0, w = 0; c < num_candidates || w < replacements->num_wildcards;) {
+            int64_t i;
+            if (w >= replacements->num_wildcards
+                || (c < num_candidates && candidates[c] < replacements->wildcards[w]))
+                i = candidates[c++];
+            else i = replacements->wildcards[w++];
+
+            replacement_t *entry = &replacements->entries[i];
+            if (!contexts[i].pattern) contexts[i] = new_match_ctx(text, entry->pattern);
+            if ((entry->pattern->required.length > 0 || entry->pattern->anchored)
+                && skip_to_candidate(&contexts[i], pos) != pos)
+                continue;
+            capture_t *captures = ctx_captures(&contexts[i]);
+            int64_t len = match(&contexts[i], pos, 0, captures, 1);
             if (len < 0) continue;
-            captures[0].index = pos;
-            captures[0].length = len;
+            captures[0] = (capture_t){.index = pos, .length = len};
 
             // If we skipped over some non-matching text before finding a match,
             // insert it here:
             if (pos > nonmatch_pos) {
                 Text_t before_slice = Text$slice(text, I(nonmatch_pos + 1), I(pos));
-                ret = Text$concat(ret, before_slice);
+                add_text(&ret, before_slice);
             }
 
             // Concatenate the replacement:
-            Text_t replacement = *(Text_t *)(replacements.data + i * replacements.stride + sizeof(Text_t));
-            Text_t replacement_text =
-                apply_backrefs(text, recursive ? replacements : (List_t){}, replacement, backref_marker, captures);
-            ret = Text$concat(ret, replacement_text);
+            Text_t replacement_text = apply_backrefs(text, recursive ? replacements : NULL, entry->replacement,
+                                                     backref_marker, captures, entry->pattern->num_captures + 1);
+            add_text(&ret, replacement_text);
             pos += MAX(len, 1);
             nonmatch_pos = pos;
             goto next_pos;
         }
 
         pos += 1;
+        if (replacements->num_wildcards == 0) {
+            // Optimization: skip ahead to where some entry's prefix could start:
+            while (pos < text.length && trie_child(replacements, 0, Text$get_grapheme_fast(&state, pos)) <= 0)
+                pos += 1;
+        }
     next_pos:
         continue;
     }
 
     if (nonmatch_pos <= text.length) {
         Text_t last_slice = Text$slice(text, I(nonmatch_pos + 1), I(text.length));
-        ret = Text$concat(ret, last_slice);
+        add_text(&ret, last_slice);
     }
-    return ret;
+    return finish_text(&ret);
 }
 
 static Text_t Pattern$replace_all(Text_t text, Table_t replacements, Text_t backref_marker, bool recursive) {
-    return replace_list(text, replacements.entries, backref_marker, recursive);
+    List_t entries = replacements.entries;
+    replacement_t *compiled = GC_MALLOC(sizeof(replacement_t) * (size_t)MAX(entries.length, 1));
+    for (int64_t i = 0; i < entries.length; i++) {
+        Text_t pattern = *(Text_t *)(entries.data + i * entries.stride);
+        Text_t replacement = *(Text_t *)(entries.data + i * entries.stride + sizeof(Text_t));
+        compiled[i] = (replacement_t){Pattern$compile(pattern), replacement};
+    }
+    return replace_list(text, new_replacement_set(compiled, entries.length), backref_marker, recursive);
+}
+
+static replacement_set_t *Pattern$compile_set(List_t patterns) {
+    // A pattern set is a replacement set whose replacements are never used:
+    replacement_t *compiled = GC_MALLOC(sizeof(replacement_t) * (size_t)MAX(patterns.length, 1));
+    for (int64_t i = 0; i < patterns.length; i++) {
+        Text_t pattern = *(Text_t *)(patterns.data + i * patterns.stride);
+        compiled[i] = (replacement_t){Pattern$compile(pattern), EMPTY_TEXT};
+    }
+    return new_replacement_set(compiled, patterns.length);
+}
+
+static List_t Pattern$set_indices(Text_t text, replacement_set_t *set, bool first_only) {
+    // Returns the (1-based) indices of the patterns in the set that appear in
+    // the text. Patterns with a literal prefix are found together in a single
+    // pass over the text using the set's trie, and only the ones whose prefix
+    // shows up are ever tried. The rest are each searched for on their own.
+    bool *found = GC_MALLOC_ATOMIC(sizeof(bool) * (size_t)MAX(set->length, 1));
+    memset(found, 0, sizeof(bool) * (size_t)MAX(set->length, 1));
+    match_ctx_t *contexts = GC_MALLOC(sizeof(match_ctx_t) * (size_t)MAX(set->length, 1));
+    int64_t num_found = 0, num_indexed = set->length - set->num_wildcards;
+
+    TextIter_t state = NEW_TEXT_ITER_STATE(text);
+    for (int64_t pos = 0; pos < text.length && num_found < num_indexed;) {
+        for (int64_t depth = 0, node = 0; pos + depth < text.length; depth++) {
+            node = trie_child(set, node, Text$get_grapheme_fast(&state, pos + depth));
+            if (node <= 0) break;
+            for (int64_t i = set->node_entries[node]; i >= 0; i = set->next_in_node[i]) {
+                if (found[i]) continue;
+                if (!contexts[i].pattern) contexts[i] = new_match_ctx(text, set->entries[i].pattern);
+                if (set->entries[i].pattern->required.length > 0 && skip_to_candidate(&contexts[i], pos) != pos)
+                    continue;
+                if (match(&contexts[i], pos, 0, NULL, 0) < 0) continue;
+                found[i] = true;
+                num_found += 1;
+                if (first_only) goto done;
+            }
+        }
+
+        // Skip ahead to where some pattern's prefix could start:
+        pos += 1;
+        while (pos < text.length && trie_child(set, 0, Text$get_grapheme_fast(&state, pos)) <= 0)
+            pos += 1;
+    }
+
+    for (int64_t w = 0; w < set->num_wildcards; w++) {
+        int64_t i = set->wildcards[w];
+        match_ctx_t ctx = new_match_ctx(text, set->entries[i].pattern);
+        if (!ctx_has(&ctx, I_small(1))) continue;
+        found[i] = true;
+        if (first_only) break;
+    }
+
+done:;
+    List_t indices = {};
+    for (int64_t i = 0; i < set->length; i++) {
+        if (!found[i]) continue;
+        Int_t index = I(i + 1);
+        List$insert(&indices, &index, I_small(0), sizeof(Int_t));
+    }
+    return indices;
 }
 
-static List_t Pattern$split(Text_t text, Text_t pattern) {
+static List_t Pattern$split(Text_t text, compiled_pattern_t *pattern) {
     if (text.length == 0) // special case
         return EMPTY_LIST;
 
-    if (pattern.length == 0) // special case
+    if (pattern->num_pats == 0) // special case
         return Text$clusters(text);
 
     List_t chunks = {};
 
+    match_ctx_t ctx = new_match_ctx(text, pattern);
     int64_t i = 0;
     for (;;) {
         int64_t len = 0;
-        int64_t found = _find(text, pattern, i, text.length - 1, &len, NULL);
-        if (found == i && len == 0) found = _find(text, pattern, i + 1, text.length - 1, &len, NULL);
+        int64_t found = _find(&ctx, i, text.length - 1, &len, NULL);
+        if (found == i && len == 0) found = _find(&ctx, i + 1, text.length - 1, &len, NULL);
         if (found < 0) break;
         Text_t chunk = Text$slice(text, I(i + 1), I(found));
         List$insert(&chunks, &chunk, I_small(0), sizeof(Text_t));
@@ -1180,22 +2899,22 @@ static List_t Pattern$split(Text_t text, Text_t pattern) {
 }
 
 typedef struct {
-    TextIter_t state;
+    match_ctx_t ctx;
     int64_t i;
-    Text_t pattern;
 } split_iter_state_t;
 
 static OptionalText_t next_split(split_iter_state_t *state) {
-    Text_t text = state->state.stack[0].text;
+    Text_t text = state->ctx.text_state.stack[0].text;
+    const compiled_pattern_t *pattern = state->ctx.pattern;
     if (state->i >= text.length) {
-        if (state->pattern.length > 0 && state->i == text.length) { // special case
+        if (pattern->num_pats > 0 && state->i == text.length) { // special case
             state->i = text.length + 1;
             return EMPTY_TEXT;
         }
         return NONE_TEXT;
     }
 
-    if (state->pattern.length == 0) { // special case
+    if (pattern->num_pats == 0) { // special case
         Text_t ret = Text$cluster(text, I(state->i + 1));
         state->i += 1;
         return ret;
@@ -1203,26 +2922,121 @@ static OptionalText_t next_split(split_iter_state_t *state) {
 
     int64_t start = state->i;
     int64_t len = 0;
-    int64_t found = _find(text, state->pattern, start, text.length - 1, &len, NULL);
+    int64_t found = _find(&state->ctx, start, text.length - 1, &len, NULL);
 
-    if (found == start && len == 0) found = _find(text, state->pattern, start + 1, text.length - 1, &len, NULL);
+    if (found == start && len == 0) found = _find(&state->ctx, start + 1, text.length - 1, &len, NULL);
 
     if (found >= 0) {
         state->i = MAX(found + len, state->i + 1);
         return Text$slice(text, I(start + 1), I(found));
     } else {
-        state->i = state->state.stack[0].text.length + 1;
+        state->i = text.length + 1;
         return Text$slice(text, I(start + 1), I(text.length));
     }
 }
 
-static Closure_t Pattern$by_split(Text_t text, Text_t pattern) {
+static Closure_t Pattern$by_split(Text_t text, compiled_pattern_t *pattern) {
     return (Closure_t){
         .fn = (void *)next_split,
-        .userdata = new (split_iter_state_t, .state = NEW_TEXT_ITER_STATE(text), .i = 0, .pattern = pattern),
+        .userdata = new (split_iter_state_t, .ctx = new_match_ctx(text, pattern), .i = 0),
     };
 }
 
+// Reads a file one line at a time through a fixed-size buffer that only grows
+// when a single line doesn't fit in it:
+typedef struct {
+    Text_t path;
+    int fd;
+    bool eof;
+    char *buf;
+    size_t capacity, start, end, searched;
+    int64_t line_number;
+    compiled_pattern_t *pattern;
+    bool only_matching;
+} line_reader_t;
+
+static void close_line_reader(line_reader_t *reader) {
+    if (reader->fd > STDIN_FILENO) close(reader->fd);
+    reader->fd = -1;
+}
+
+static void line_reader_finalizer(void *obj, void *data) {
+    (void)data;
+    close_line_reader(obj);
+}
+
+static bool read_line(line_reader_t *reader, Text_t *line) {
+    for (;;) {
+        char *newline = memchr(reader->buf + reader->searched, '\n', reader->end - reader->searched);
+        if (newline || (reader->eof && reader->start < reader->end)) {
+            size_t line_end = newline ? (size_t)(newline - reader->buf) : reader->end;
+            const char *str = reader->buf + reader->start;
+            size_t len = line_end - reader->start;
+            if (len > 0 && str[len - 1] == '\r') len -= 1;
+            reader->line_number += 1;
+            reader->start = reader->searched = newline ? line_end + 1 : reader->end;
+            if (u8_check((const uint8_t *)str, len)) {
+                close_line_reader(reader);
+                fail_text(Texts("Invalid UTF-8 on line ", reader->line_number, " of ", reader->path));
+            }
+            *line = Text$from_strn(str, len);
+            return true;
+        }
+        if (reader->eof) return false;
+
+        // Keep the unfinished line and read the next chunk after it:
+        if (reader->start > 0) {
+            memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        reader->searched = reader->end;
+        if (reader->capacity - reader->end < LINE_READER_CHUNK_SIZE) {
+            char *bigger = GC_MALLOC_ATOMIC(2 * reader->capacity);
+            memcpy(bigger, reader->buf, reader->end);
+            reader->buf = bigger;
+            reader->capacity *= 2;
+        }
+        ssize_t n = read(reader->fd, reader->buf + reader->end, reader->capacity - reader->end);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            const char *error = strerror(errno);
+            close_line_reader(reader);
+            fail_text(Texts("Could not read ", reader->path, ": ", error));
+        }
+        if (n == 0) reader->eof = true;
+        reader->end += (size_t)n;
+    }
+}
+
+static OptionalPatternLine next_line(line_reader_t *reader) {
+    Text_t line;
+    while (reader->fd >= 0) {
+        if (!read_line(reader, &line)) {
+            close_line_reader(reader);
+            break;
+        }
+        if (!reader->only_matching || Pattern$has(line, reader->pattern, I_small(0)))
+            return (OptionalPatternLine){.text = line, .line_number = I(reader->line_number)};
+    }
+    return NONE_LINE;
+}
+
+static Closure_t Pattern$by_line(Text_t path, compiled_pattern_t *pattern, bool only_matching) {
+    // Lines are read from the file as they're needed, so memory use depends on
+    // the length of the longest line rather than the size of the file:
+    const char *path_str = Text$as_c_string(path);
+    int fd = strcmp(path_str, "-") == 0 ? STDIN_FILENO : open(path_str, O_RDONLY);
+    if (fd < 0) fail_text(Texts("Could not open ", path, ": ", strerror(errno)));
+
+    size_t capacity = 2 * LINE_READER_CHUNK_SIZE;
+    line_reader_t *reader = new (line_reader_t, .path = path, .fd = fd, .buf = GC_MALLOC_ATOMIC(capacity),
+                                 .capacity = capacity, .pattern = pattern, .only_matching = only_matching);
+    // In case the caller stops iterating before the end of the file:
+    if (fd != STDIN_FILENO) GC_register_finalizer(reader, line_reader_finalizer, NULL, NULL, NULL);
+    return (Closure_t){.fn = (void *)next_line, .userdata = reader};
+}
+
 static Text_t Pattern$escape_text(Text_t text) {
     // TODO: optimize for spans of non-escaped text
     Text_t ret = EMPTY_TEXT;
@@ -1246,6 +3060,11 @@ static Text_t Pattern$as_text(const void *obj, bool colorize, const TypeInfo_t *
     if (!obj) return Text("Pattern");
 
     Text_t pat = *(Text_t *)obj;
-    Text_t quote = Pattern$has(pat, Text("/")) && !Pattern$has(pat, Text("|")) ? Text("|") : Text("/");
+    // These are compiled outside the cache so they don't crowd out the user's
+    // patterns or show up in its stats:
+    Text_t quote = Pattern$has(pat, compile_pattern(Text("/")), I_small(1))
+                           && !Pattern$has(pat, compile_pattern(Text("|")), I_small(1))
+                       ? Text("|")
+                       : Text("/");
     return Text$concat(colorize ? Text("\x1b[1m$\033[m") : Text("$"), Text$quoted(pat, colorize, quote));
 }
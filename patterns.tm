@@ -2,6 +2,10 @@ use ./patterns.c
 use -lunistring
 
 struct PatternMatch(text:Text, index:Int, captures:[Text])
+struct PatternCacheStats(hits:Int, misses:Int, evictions:Int, size:Int, capacity:Int)
+struct PatternStats(starts:Int, recursions:Int, backtracks:Int, function_calls:Int, graphemes:Int)
+struct PatternLine(text:Text, line_number:Int)
+struct PatternSpan(start:Int, len:Int)
 
 lang Replacement
     convert(text:Text -> Replacement)
@@ -14,63 +18,305 @@ lang Pat
     convert(n:Int -> Pat)
         return Pat.from_text("$n")
 
+    func compile(pattern:Pat -> CompiledPat)
+        return CompiledPat(pattern, C_code:@Memory`Pattern$compile(@pattern)`)
+
+    func cache_stats(-> PatternCacheStats)
+        stats : PatternCacheStats
+        C_code ` Pattern$cache_stats((void*)&@stats); `
+        return stats
+
+    func set_cache_capacity(capacity:Int)
+        C_code ` Pattern$set_cache_capacity(@capacity); `
+
+    func stats(pattern:Pat -> PatternStats)
+        return pattern.compile().stats()
+
+    func dump_stats()
+        C_code ` Pattern$dump_stats(); `
+
     func match(pattern:Pat, text:Text, pos:Int = 1 -> PatternMatch?)
-        result : PatternMatch
-        if C_code:Bool`Pattern$match_at(@text, @pattern, @pos, (void*)&@result)`
-            return result
-        return none
+        return pattern.compile().match(text, pos)
 
     func matches(pattern:Pat, text:Text -> Bool)
-        return C_code:Bool`Pattern$matches(@text, @pattern)`
+        return pattern.compile().matches(text)
 
     func capture(pattern:Pat, text:Text -> [Text]?)
-        return C_code:[Text]?`Pattern$captures(@text, @pattern)`
+        return pattern.compile().capture(text)
 
     func replace(pattern:Pat, text:Text, replacement:Text, backref="@", recursive=yes -> Text)
-        return C_code:Text`Pattern$replace(@text, @pattern, @replacement, @backref, @recursive)`
+        return pattern.compile().replace(text, replacement, backref, recursive)
 
     func translate(replacements:{Pat:Text}, text:Text, backref="@", recursive=yes -> Text)
         return C_code:Text`Pattern$replace_all(@text, @replacements, @backref, @recursive)`
 
-    func is_in(pattern:Pat, text:Text -> Bool)
-        return C_code:Bool`Pattern$has(@text, @pattern)`
+    func is_in(pattern:Pat, text:Text, threads=0 -> Bool)
+        return pattern.compile().is_in(text, threads)
 
-    func find_in(pattern:Pat, text:Text -> [PatternMatch])
-        return C_code:[PatternMatch]`Pattern$find_all(@text, @pattern)`
+    func find_in(pattern:Pat, text:Text, threads=0 -> [PatternMatch])
+        return pattern.compile().find_in(text, threads)
+
+    func count_in(pattern:Pat, text:Text, threads=0 -> Int)
+        return pattern.compile().count_in(text, threads)
+
+    func spans_in(pattern:Pat, text:Text, threads=0 -> [PatternSpan])
+        return pattern.compile().spans_in(text, threads)
+
+    func is_in_each(pattern:Pat, texts:[Text], threads=0 -> [Bool])
+        return pattern.compile().is_in_each(texts, threads)
+
+    func capture_each(pattern:Pat, texts:[Text], threads=0 -> [[Text]?])
+        return pattern.compile().capture_each(texts, threads)
+
+    func find_in_each(pattern:Pat, texts:[Text], threads=0 -> [[PatternMatch]])
+        return pattern.compile().find_in_each(texts, threads)
 
     func each_match(pattern:Pat, text:Text -> func(->PatternMatch?))
-        return C_code:func(->PatternMatch?)`Pattern$by_match(@text, @pattern)`
+        return pattern.compile().each_match(text)
 
     func for_each(pattern:Pat, text:Text, fn:func(m:PatternMatch), recursive=yes)
-        C_code ` Pattern$each(@text, @pattern, @fn, @recursive); `
+        pattern.compile().for_each(text, fn, recursive)
 
     func map(pattern:Pat, text:Text, fn:func(m:PatternMatch -> Text), recursive=yes -> Text)
-        return C_code:Text`Pattern$map(@text, @pattern, @fn, @recursive)`
+        return pattern.compile().map(text, fn, recursive)
 
     func split(pattern:Pat, text:Text -> [Text])
-        return C_code:[Text]`Pattern$split(@text, @pattern)`
+        return pattern.compile().split(text)
 
     func by_split(pattern:Pat, text:Text -> func(->Text?))
-        return C_code:func(->Text?)`Pattern$by_split(@text, @pattern)`
+        return pattern.compile().by_split(text)
 
     func trim(pattern:Pat, text:Text, left=yes, right=yes -> Text)
-        return C_code:Text`Pattern$trim(@text, @pattern, @left, @right)`
-
-
-func main(text:Text, pattern:Pat, replacement:Text?=none)
-    if r := replacement
-        say(pattern.replace(text, r))
-    else
-        say("Matches: $(pattern.find_in(text))")
-
-    # >> "Hello world".match($Pat'{id}')
-    # >> "...Hello world".match($Pat'{id}')
-# func main(pattern:Pat, input=(/dev/stdin))
-#     for line in input.by_line()!
-#         skip if not line.has_pattern(pattern)
-#         pos := 1
-#         for match in line.by_pattern(pattern)
-#             say(line.slice(pos, match.index-1), newline=no)
-#             say("\033[34;1m$(match.text)\033[m", newline=no)
-#             pos = match.index + match.text.length
-#         say(line.from(pos), newline=yes)
+        return pattern.compile().trim(text, left, right)
+
+    func by_line(pattern:Pat, path:Text, only_matching=yes -> func(->PatternLine?))
+        return pattern.compile().by_line(path, only_matching)
+
+    func limit(pattern:Pat, steps:Int?=none, seconds:Num?=none -> LimitedPat)
+        return LimitedPat(pattern, steps, seconds)
+
+struct CompiledPat(pattern:Pat, _program:@Memory)
+    func match(compiled:CompiledPat, text:Text, pos:Int = 1 -> PatternMatch?)
+        program := compiled._program
+        result : PatternMatch
+        if C_code:Bool`Pattern$match_at(@text, @program, @pos, (void*)&@result)`
+            return result
+        return none
+
+    func stats(compiled:CompiledPat -> PatternStats)
+        program := compiled._program
+        stats : PatternStats
+        C_code ` Pattern$stats(@program, (void*)&@stats); `
+        return stats
+
+    func matches(compiled:CompiledPat, text:Text -> Bool)
+        program := compiled._program
+        return C_code:Bool`Pattern$matches(@text, @program)`
+
+    func capture(compiled:CompiledPat, text:Text -> [Text]?)
+        program := compiled._program
+        return C_code:[Text]?`Pattern$captures(@text, @program)`
+
+    func replace(compiled:CompiledPat, text:Text, replacement:Text, backref="@", recursive=yes -> Text)
+        program := compiled._program
+        return C_code:Text`Pattern$replace(@text, @program, @replacement, @backref, @recursive)`
+
+    func is_in(compiled:CompiledPat, text:Text, threads=0 -> Bool)
+        program := compiled._program
+        return C_code:Bool`Pattern$has(@text, @program, @threads)`
+
+    func find_in(compiled:CompiledPat, text:Text, threads=0 -> [PatternMatch])
+        program := compiled._program
+        return C_code:[PatternMatch]`Pattern$find_all(@text, @program, @threads)`
+
+    func count_in(compiled:CompiledPat, text:Text, threads=0 -> Int)
+        program := compiled._program
+        return C_code:Int`Pattern$count(@text, @program, @threads)`
+
+    func spans_in(compiled:CompiledPat, text:Text, threads=0 -> [PatternSpan])
+        program := compiled._program
+        return C_code:[PatternSpan]`Pattern$spans(@text, @program, @threads)`
+
+    func is_in_each(compiled:CompiledPat, texts:[Text], threads=0 -> [Bool])
+        program := compiled._program
+        return C_code:[Bool]`Pattern$has_each(@texts, @program, @threads)`
+
+    func capture_each(compiled:CompiledPat, texts:[Text], threads=0 -> [[Text]?])
+        program := compiled._program
+        return C_code:[[Text]?]`Pattern$captures_each(@texts, @program, @threads)`
+
+    func find_in_each(compiled:CompiledPat, texts:[Text], threads=0 -> [[PatternMatch]])
+        program := compiled._program
+        return C_code:[[PatternMatch]]`Pattern$find_all_each(@texts, @program, @threads)`
+
+    func each_match(compiled:CompiledPat, text:Text -> func(->PatternMatch?))
+        program := compiled._program
+        return C_code:func(->PatternMatch?)`Pattern$by_match(@text, @program)`
+
+    func for_each(compiled:CompiledPat, text:Text, fn:func(m:PatternMatch), recursive=yes)
+        program := compiled._program
+        C_code ` Pattern$each(@text, @program, @fn, @recursive); `
+
+    func map(compiled:CompiledPat, text:Text, fn:func(m:PatternMatch -> Text), recursive=yes -> Text)
+        program := compiled._program
+        return C_code:Text`Pattern$map(@text, @program, @fn, @recursive)`
+
+    func split(compiled:CompiledPat, text:Text -> [Text])
+        program := compiled._program
+        return C_code:[Text]`Pattern$split(@text, @program)`
+
+    func by_split(compiled:CompiledPat, text:Text -> func(->Text?))
+        program := compiled._program
+        return C_code:func(->Text?)`Pattern$by_split(@text, @program)`
+
+    func trim(compiled:CompiledPat, text:Text, left=yes, right=yes -> Text)
+        program := compiled._program
+        return C_code:Text`Pattern$trim(@text, @program, @left, @right)`
+
+    func by_line(compiled:CompiledPat, path:Text, only_matching=yes -> func(->PatternLine?))
+        program := compiled._program
+        return C_code:func(->PatternLine?)`Pattern$by_line(@path, @program, @only_matching)`
+
+
+# A pattern whose matching gives up (with a `none` result) once it has taken
+# more than `steps` backtracking steps or `seconds` of time:
+struct LimitedPat(pattern:Pat, steps:Int?=none, seconds:Num?=none)
+    func _begin(limited:LimitedPat)
+        max_steps := limited.steps or 0
+        max_seconds := limited.seconds or 0.0
+        C_code ` Pattern$begin_budget(@max_steps, @max_seconds); `
+
+    func _exceeded(limited:LimitedPat -> Bool)
+        return C_code:Bool`Pattern$end_budget()`
+
+    func matches(limited:LimitedPat, text:Text -> Bool?)
+        limited._begin()
+        result := limited.pattern.matches(text)
+        if limited._exceeded()
+            return none
+        return result
+
+    func is_in(limited:LimitedPat, text:Text -> Bool?)
+        limited._begin()
+        result := limited.pattern.is_in(text, threads=1)
+        if limited._exceeded()
+            return none
+        return result
+
+    func find_in(limited:LimitedPat, text:Text -> [PatternMatch]?)
+        limited._begin()
+        result := limited.pattern.find_in(text, threads=1)
+        if limited._exceeded()
+            return none
+        return result
+
+    func count_in(limited:LimitedPat, text:Text -> Int?)
+        limited._begin()
+        result := limited.pattern.count_in(text, threads=1)
+        if limited._exceeded()
+            return none
+        return result
+
+    func spans_in(limited:LimitedPat, text:Text -> [PatternSpan]?)
+        limited._begin()
+        result := limited.pattern.spans_in(text, threads=1)
+        if limited._exceeded()
+            return none
+        return result
+
+    func replace(limited:LimitedPat, text:Text, replacement:Text, backref="@", recursive=yes -> Text?)
+        limited._begin()
+        result := limited.pattern.replace(text, replacement, backref, recursive)
+        if limited._exceeded()
+            return none
+        return result
+
+    func is_in_each(limited:LimitedPat, texts:[Text] -> [Bool]?)
+        limited._begin()
+        result := limited.pattern.is_in_each(texts, threads=1)
+        if limited._exceeded()
+            return none
+        return result
+
+    func capture_each(limited:LimitedPat, texts:[Text] -> [[Text]?]?)
+        limited._begin()
+        result := limited.pattern.capture_each(texts, threads=1)
+        if limited._exceeded()
+            return none
+        return result
+
+    func find_in_each(limited:LimitedPat, texts:[Text] -> [[PatternMatch]]?)
+        limited._begin()
+        result := limited.pattern.find_in_each(texts, threads=1)
+        if limited._exceeded()
+            return none
+        return result
+
+    func map(limited:LimitedPat, text:Text, fn:func(m:PatternMatch -> Text), recursive=yes -> Text?)
+        limited._begin()
+        result := limited.pattern.map(text, fn, recursive)
+        if limited._exceeded()
+            return none
+        return result
+
+    func for_each(limited:LimitedPat, text:Text, fn:func(m:PatternMatch), recursive=yes -> Bool)
+        # Returns `no` if the budget ran out before the end of the text (after
+        # calling `fn` on the matches found up to then):
+        limited._begin()
+        limited.pattern.for_each(text, fn, recursive)
+        return not limited._exceeded()
+
+    func split(limited:LimitedPat, text:Text -> [Text]?)
+        limited._begin()
+        result := limited.pattern.split(text)
+        if limited._exceeded()
+            return none
+        return result
+
+    func trim(limited:LimitedPat, text:Text, left=yes, right=yes -> Text?)
+        limited._begin()
+        result := limited.pattern.trim(text, left, right)
+        if limited._exceeded()
+            return none
+        return result
+
+struct PatSet(patterns:[Pat], _set:@Memory)
+    func compile(patterns:[Pat] -> PatSet)
+        return PatSet(patterns, C_code:@Memory`Pattern$compile_set(@patterns)`)
+
+    func indices_in(set:PatSet, text:Text, first=no -> [Int])
+        program := set._set
+        return C_code:[Int]`Pattern$set_indices(@text, @program, @first)`
+
+    func is_in(set:PatSet, text:Text -> Bool)
+        return set.indices_in(text, first=yes).length > 0
+
+func main(pattern:Pat, files:[Text]=["-"], text:Text?=none, replace:Text?=none, count=no, spans=no)
+    if t := text
+        if r := replace
+            say(pattern.replace(t, r))
+        else
+            say("Matches: $(pattern.find_in(t))")
+        return
+
+    compiled := pattern.compile()
+    for file in files
+        prefix := ""
+        if files.length > 1
+            prefix = "$file:"
+
+        if r := replace
+            for line in compiled.by_line(file, only_matching=no)
+                say("$prefix$(compiled.replace(line.text, r))")
+        else if count
+            matching := 0
+            for line in compiled.by_line(file)
+                matching += 1
+            say("$prefix$matching")
+        else if spans
+            for line in compiled.by_line(file)
+                for m in compiled.find_in(line.text)
+                    say("$prefix$(line.line_number):$(m.index):$(m.text)")
+        else
+            for line in compiled.by_line(file)
+                say("$prefix$(line.text)")